@@ -23,7 +23,12 @@
 /// terminal will display some stats. The color window is live feed
 /// so do not move the colored object or the camera. The bounding box
 /// for the calibration channel will show up as a rectangle covering
-/// that area.
+/// that area. The thresholds are the calibPercentile and 100 minus
+/// calibPercentile percentiles of H, S and V in the box (-calibpct),
+/// so a few stray pixels do not widen them. The H, S and V histograms
+/// of the box (CalibHistogram) are updated with only the pixels that
+/// enter or leave it as it is dragged, and nothing is recomputed while
+/// it stays still.
 ///
 /// Tracking mode:
 /// Once the bounding box adequately covers the desired color,
@@ -33,6 +38,176 @@
 /// channel number key for a different channel and  then right
 /// click to enter calibration mode again.
 ///
+/// Press f to cycle the thresholding method, to compare frame times:
+/// fused single-pass threshold of all 3 channels (default), the
+/// original 3 inRange calls, or a BGR lookup table (LUTBITS) that
+/// skips the HSV conversion. The table is rebuilt only when the
+/// thresholds change. YUYV frames from a V4L2 camera are thresholded
+/// straight from the packed Y, U and V bytes with a second table built
+/// alongside (yuvLUT), in both the fused and LUT modes. 4:2:0 frames
+/// (NV12, I420) are thresholded at chroma resolution in every mode:
+/// each U, V sample and the mean of the 4 luma samples it covers are
+/// looked up in yuvLUT, so a quarter of the pixels are thresholded,
+/// eroded and labelled, and the rects are scaled back to full
+/// resolution. The fused and LUT methods erode each row as soon
+/// as the row below it is thresholded (thresholdErode3), so their masks
+/// are written once and the erode is timed as part of the threshold
+/// stage.
+///
+/// Press r to toggle ROI tracking. Only windows around the color codes
+/// found in the previous frames (drawn in gray) are processed, with a
+/// full frame search every ROIREFRESHPERIOD frames or when a color
+/// code is lost. Each code is followed by a constant velocity Kalman
+/// filter (CCTrack), so its window is centred where it is predicted to
+/// be and grows with the uncertainty of the prediction. A code missed
+/// by its window is predicted on for up to KALMANMAXMISSED frames
+/// before a full frame search is forced.
+///
+/// Per-stage latency histograms (capture, cvtColor, inRange, erode,
+/// getThresholdRects, dilateRects, getCCRectBinary, render, ...) are
+/// printed to stderr at exit, when h is pressed, or on SIGUSR1 when
+/// running headless.
+///
+/// Tracking reuses the buffers in trackerScratch and the frame sized
+/// masks every frame instead of allocating them, and erodes with
+/// erodeMask rather than erode, which builds its filter on the heap
+/// each call. The operator new calls and Mat allocations made by
+/// tracking are counted after ALLOCWARMUPFRAMES frames and printed per
+/// frame with the histograms. The rect, pairing and row buffers are
+/// reserved for PAIRRESERVE rects and pairs and the frame width at each
+/// thread's first frame, so in the default fused and LUT threshold
+/// modes both counts are 0 unless a frame has more blobs than that.
+/// -greedy with -multi still grows its matching buffers to the largest
+/// frame seen. Memory OpenCV takes with malloc underneath
+/// (cv::fastMalloc, AutoBuffer, cvtColor internals) is not counted.
+/// With -pipeline or several inputs, allocations made by the other
+/// threads meanwhile are counted too.
+///
+/// Giving -in more than once tracks all the inputs in one process
+/// (runMultiCamera). Each input has its own capture thread, frame
+/// queue and TrackerState, and a shared pool of workers processes the
+/// queued frames, a worker taking frames from the other inputs when
+/// its own has none. Results carry the index of their input, and the
+/// frame rate of each input and of all of them together is printed
+/// with the histograms.
+///
+/// With -reload, babyMotionConfig.txt is watched with inotify and the
+/// thresholds are reloaded whenever the file is written or replaced,
+/// without a restart. A watcher thread parses the file and builds the
+/// lookup tables for it into the inactive one of two ThresholdSets,
+/// then makes that set the active one. At the start of every frame
+/// each processing thread (each worker, with several inputs) compares
+/// thresholdVersion with the version it has and, if a newer set is
+/// out, copies it into its own thresholds and tables. A frame is
+/// processed with one set throughout, and the processing threads
+/// neither lock nor wait for the reload: a set is rewritten only once
+/// the threads still copying it are done (nReaders), and the watcher
+/// is the one that waits.
+///
+/// MJPEG input (a V4L2 camera streaming MJPEG or a file of JPEG frames)
+/// is decoded with libjpeg or libjpeg-turbo, built in with -DHAVE_JPEG
+/// and -ljpeg. With -jpegscale N the decoder scales by 1/N in the DCT
+/// domain, so a frame N times smaller is decoded straight away instead
+/// of decoding the full frame and resizing it. Rects and blob areas are
+/// then in decoded pixels. With -jpegroi only the rows and the iMCU
+/// columns covering the search windows of the next frame are decoded
+/// (jpeg_skip_scanlines, jpeg_crop_scanline) while ROI tracking follows
+/// the color codes, and the rest of the frame keeps older pixels.
+///
+/// Command line options:
+/// -threads N  run the threshold, erode, rect and dilate stages of the
+///             3 channels on a persistent pool of N threads (default 1).
+///             With several inputs, N workers shared by the inputs
+///             (default one per core), each running the channels of
+///             its frame in turn
+/// -pipeline   capture, process and display on 3 threads linked by
+///             lock-free frame queues
+/// -dropoldest with -pipeline, drop the oldest queued frame when a
+///             stage falls behind instead of waiting
+/// -headless   no windows, mouse or key handling and no drawing.
+///             Tracking mode only, stop with Ctrl-C. Results go to
+///             stdout as JSON lines unless -out says otherwise
+/// -in SPEC    read frames from SPEC instead of the 1st webcam:
+///               cam:N      camera N
+///               VIDEO      video file
+///               DIR        directory of png/jpg/bmp/ppm images, read
+///                          in file name order
+///               raw:WxH:PATH  raw 8-bit BGR frames of WxH pixels
+///                          back to back
+///               v4l2:[WxH:][nv12:|mjpeg:]DEVICE  V4L2 camera, e.g.
+///                          /dev/video0, captured as YUYV (or NV12 or
+///                          MJPEG, default 640x480) into mmap'd driver
+///                          buffers. Headless, the frame
+///                          handed to tracking is the driver buffer
+///                          itself, with no copy or BGR conversion
+///                          (one copy with -pipeline or several
+///                          inputs). With a window it is converted to
+///                          BGR once, for drawing and calibration.
+///                          MJPEG frames are decoded to BGR
+///               yuyv:WxH:PATH  raw YUYV frames of WxH pixels back to
+///                          back, delivered like v4l2 frames, e.g. to
+///                          test without a camera
+///               nv12:WxH:PATH, i420:WxH:PATH  raw 4:2:0 frames of
+///                          WxH pixels back to back, with interleaved
+///                          (NV12) or separate (I420) U and V planes.
+///                          I420 chroma is interleaved as it is read
+///               mjpeg:PATH JPEG frames back to back, e.g. from
+///                          ffmpeg -i VIDEO -c:v copy -f mjpeg PATH
+///               synth:N[,size=WxH][,marker=PX][,rot=DEG][,noise=AMP]
+///                    [,blur=K][,drift=PCT][,distract=N]
+///                          N generated two-color markers in the
+///                          colors of the configured channels, moving
+///                          and swinging, with single color distractor
+///                          blobs, pixel noise, blur and illumination
+///                          drift. Paced at 60 fps with -realtime
+///             Recordings are read as fast as possible and the frame
+///             rate is printed at the end. Give -in up to MAXCAMERAS
+///             times to track several inputs at once, headless
+/// -realtime   pace recordings to their frame rate instead, skipping
+///             frames when processing falls behind like a camera would
+/// -fps F      frame rate to pace to (default from the video, else 30)
+/// -truth PATH write the bounding rect of every generated marker to
+///             PATH, one JSON line per frame. One input only
+/// -multi      report every instance of each color code, not just the
+///             largest. Each code's overlapping channel rects are split
+///             into connected groups and each group is matched for the
+///             most pairs, then the largest total area. The largest
+///             instance still fills the per-code results, and ROI
+///             tracking searches the whole frame
+/// -pyramid N  find candidate color codes on every Nth pixel of every
+///             Nth row (N = 2 or 4) before each full frame search, and
+///             search only windows around them at full resolution.
+///             Blobs under MINAREABLOB full resolution pixels are not
+///             candidates, and there is no erode at the coarse level
+/// -jpegscale N decode MJPEG input at 1/N scale (N = 1, 2, 4 or 8)
+/// -jpegroi    start with ROI tracking on, and decode only the part of
+///             each MJPEG frame its search windows cover. One input,
+///             without -pipeline
+/// -reload     reload the thresholds whenever babyMotionConfig.txt
+///             changes
+/// -calibpct P calibrate to the Pth and (100-P)th percentiles of the
+///             box (default CALIBPERCENTILE, 0 for its min and max)
+/// -greedy     let codes 0, 1 and 2 claim channel rects in that order
+///             instead of sharing them out by a global assignment that
+///             finds the most color codes, then the largest, within
+///             ASSIGNBUDGET search nodes per frame
+/// -bench      time cvtColor+inRange, erode, getThresholdRects,
+///             dilateRects, getCCRectBinary, getBoundingBoxHSV,
+///             detectBlobs and detectCCBlobs on synthetic frames from
+///             320x240 to 3840x2160 with 1 to 64 color codes, and on the
+///             first frame of -in if given. Prints ns/frame, Mpixels/s
+///             and operator new and Mat allocations per frame, then times
+///             color code pairing for 16 to 4096 rects per channel,
+///             all pairs against the sorted sweep, and exits
+/// -out SINK   write a result record per frame (frame index, timestamp,
+///             input index, and for each color code its rect, confidence
+///             and the two channel rects it is made of) to one of
+///               jsonl      one JSON object per line on stdout
+///               bin:PATH   fixed-size FrameResult records to a file
+///                          or named pipe
+///               shm:NAME   ShmResultRing in POSIX shared memory
+///                          (link with -lrt on older glibc)
+///
 /// References:
 /// http://docs.opencv.org/3.1.0/d7/d1d/tutorial_hull.html#gsc.tab=0
 /// http://docs.opencv.org/3.1.0/da/d0c/tutorial_bounding_rects_circles.html#gsc.tab=0
@@ -46,6 +221,38 @@
 #include<opencv2/highgui/highgui.hpp>
 #include<opencv2/imgproc/imgproc.hpp>
 #include<iostream>
+#include<cstring>
+#include<algorithm>
+#include<stdint.h>
+#include<stdlib.h>
+#include<thread>
+#include<mutex>
+#include<condition_variable>
+#include<atomic>
+#include<chrono>
+#include<signal.h>
+#include<fcntl.h>
+#include<unistd.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<sys/ioctl.h>
+#include<errno.h>
+#include<linux/videodev2.h>
+#include<sys/inotify.h>
+#include<poll.h>
+#include<new>
+#include<limits>
+#if defined(HAVE_JPEG)
+#include<stdio.h>
+#include<setjmp.h>
+#include<jpeglib.h>
+#endif
+#if defined(__SSE2__)
+#include<emmintrin.h>
+#endif
+#if defined(__SSSE3__)
+#include<tmmintrin.h>
+#endif
 using namespace cv;
 using namespace std;
 
@@ -54,241 +261,4704 @@ using namespace std;
 // smaller for 320x240
 #define MINAREABLOB 64
 
+// bits kept per B, G and R (Y, U and V) component when indexing the color
+// lookup tables. 5 gives a 32x32x32 (32 KB) table, 8 gives the exact 16M
+// entry table
+#define LUTBITS 5
+
+// what thresholdErode3 thresholds
+#define THRESHSRC_HSV 0 // HSV image, range checks
+#define THRESHSRC_BGR 1 // BGR image, colorLUT
+#define THRESHSRC_YUYV 2 // packed 4:2:2 (Y0 U Y1 V) image, yuvLUT
+#define THRESHSRC_NV12 3 // luma plane and interleaved U V plane, yuvLUT at chroma resolution
+
+// thresholding methods
+#define THRESH_INRANGE 0 // 3 inRange calls on the HSV image
+#define THRESH_FUSED 1 // single pass over the HSV image
+#define THRESH_LUT 2 // BGR lookup table, no HSV conversion
+
+// ROI tracking mode
+#define ROIREFRESHPERIOD 30 // search the whole frame at least this often [frames]
+#define ROIEXPAND 100 // amount to increase a predicted rect by to get its search window [%]
+#define KALMANACCEL 8.0 // std dev of the acceleration a track does not model, bounces included [px/frame^2]
+#define KALMANNOISE 2.0 // std dev of a detected color code centre [px]
+#define KALMANSIGMAS 3.0 // search windows cover this many std devs of the predicted centre
+#define KALMANMAXMISSED 1 // frames a track is predicted through without a detection
+#define PYRAMIDPAD 3 // coarse pixels added around a -pyramid candidate to get its search window
+
+// threshold configuration
+#define CONFIGPATH "babyMotionConfig.txt" // HSV thresholds, read at startup and written at exit
+#define RELOADPOLLMS 100 // the -reload watcher checks for the end of tracking this often [ms]
+
+// calibration mode
+#define CALIBPERCENTILE 1.0 // default -calibpct, share of the box left out at each end of each range [%]
+
+// bounding box and size of one connected blob in a binary image
+struct BlobInfo {
+	Rect rect;
+	int pixelCount;
+};
+
+// horizontal run of foreground pixels x1..x2 (inclusive) in one row
+struct BlobRun {
+	int x1;
+	int x2;
+	int label;
+};
+
+// detection of one color code, fixed size so results can be written as is
+struct CCResult {
+	int32_t found; // 1 if detected in this frame
+	int32_t rect[4]; // x, y, width, height of the color code
+	float confidence; // overlap of the two channel rects over the smaller one, 0..1
+	int32_t partA[4]; // channel rects the color code is made of
+	int32_t partB[4];
+};
+
+// one of several detections of a color code, with -multi
+struct CCInstance {
+	int32_t code;
+	CCResult cc;
+};
+
+// results of one frame, written as is (native byte order) by the binary
+// and shared memory sinks
+#define RESULTMAGIC 0x33524343 // "CCR3"
+#define MAXCCINSTANCES 64 // color code instances reported per frame with -multi
+struct FrameResult {
+	uint32_t magic;
+	uint32_t frameIndex;
+	double timestamp; // seconds since the tracker started
+	int32_t camera; // index of the -in input the frame came from
+	CCResult cc[3]; // color codes 0 (ch1+ch2), 1 (ch1+ch3), 2 (ch2+ch3), the largest with -multi
+	int32_t nInstances; // with -multi, every color code found, else 0
+	CCInstance instances[MAXCCINSTANCES];
+};
+
+// a pair of overlapping channel rects making up a color code
+struct CCMatch {
+	int code;
+	int partA; // index into the first channel's rects
+	int partB; // index into the second channel's rects
+	Rect rect; // union of the two
+};
+#define MATCHBONUS ((int64_t)1 << 40) // assignment weight of a match, above any union area
+#define HUNGARIANMAX 128 // larger overlap components are matched greedily
+#define ASSIGNBUDGET 20000 // search nodes per frame for the global assignment
+#define PAIRRESERVE 1024 // rects and pairs the rect and pairing buffers are sized for at their first frame
+
+// branch and bound state of the global assignment across color codes
+struct AssignSearch {
+	vector<CCMatch> edges; // candidate pairs, sorted by weight within each group
+	vector<int64_t> weights; // MATCHBONUS + union area of each edge
+	vector<int> nodeA, nodeB; // rects of each edge, numbered over all 3 channels
+	vector<char> nodeUsed;
+	vector<int> nodeFirst; // multi mode: first edge at each rect
+	vector<int> nextA, nextB; // multi mode: next edge at the same rect, or -1, for the bound
+	vector<int> chosen, bestChosen; // edges taken on the current and best path
+	vector<int> order; // multi mode: edges grouped by component
+	vector<CCMatch> sortedEdges; // multi mode: edges, weights and nodes in that order
+	vector<int64_t> sortedWeights;
+	vector<int> sortedNodeA, sortedNodeB;
+	int64_t bestWeight;
+	int codeStart[4]; // single mode: edges of code c are [codeStart[c], codeStart[c+1])
+	int first, last; // multi mode: edges of the current component
+	int nBest; // multi mode: the current component's pairs at the end of bestChosen
+	int nNodes; // nodes visited this frame
+};
+
+// shared memory ring of frame results, a seqlock over the slots. To
+// write record n the writer sets startCount to n + 1, issues a release
+// fence, fills records[n % SHMRINGSIZE] and then sets writeCount to
+// n + 1 with release. A reader loads writeCount with acquire and copies
+// record n once writeCount > n, then issues an acquire fence and keeps
+// the copy if startCount < n + SHMRINGSIZE + 1 still holds, i.e. the
+// write of record n + SHMRINGSIZE, which reuses the slot, has not begun.
+#define SHMRINGSIZE 256
+struct ShmResultRing {
+	uint32_t magic;
+	uint32_t recordSize; // sizeof(FrameResult)
+	uint32_t capacity; // SHMRINGSIZE
+	uint32_t reserved;
+	std::atomic<uint64_t> writeCount; // records completely written
+	std::atomic<uint64_t> startCount; // records whose write has begun
+	FrameResult records[SHMRINGSIZE];
+};
+
+// result sinks
+#define SINK_NONE 0
+#define SINK_JSONL 1 // one JSON object per line on stdout
+#define SINK_BINARY 2 // FrameResult records to a file or pipe
+#define SINK_SHM 3 // ShmResultRing in POSIX shared memory
+
+// pipeline stages timed by StageTimer
+enum {
+	STAGE_CAPTURE,
+	STAGE_COARSE, // -pyramid candidate search
+	STAGE_CVTCOLOR,
+	STAGE_INRANGE1,
+	STAGE_INRANGE2,
+	STAGE_INRANGE3,
+	STAGE_THRESHOLD, // fused or LUT threshold of all 3 channels
+	STAGE_ERODE,
+	STAGE_RECTS, // getThresholdRects
+	STAGE_DILATE, // dilateRects
+	STAGE_PAIRING, // getCCRectBinary
+	STAGE_RENDER, // drawing and imshow
+	STAGE_FRAME, // whole processFrame
+	NSTAGES
+};
+
+// log-linear latency histogram buckets (HDR style): values below
+// 2*HISTSUB ns get a bucket each, above that every power of 2 is split
+// into HISTSUB buckets, so any value is off by at most 1/HISTSUB
+#define HISTSUBBITS 4
+#define HISTSUB (1 << HISTSUBBITS)
+#define HISTBUCKETS (40*HISTSUB) // covers up to ~2^40 ns (18 min)
+
+// latency histogram of one stage, updated lock-free from any thread
+struct StageHistogram {
+	std::atomic<uint64_t> counts[HISTBUCKETS];
+	std::atomic<uint64_t> nSamples;
+	std::atomic<uint64_t> sumNs;
+	std::atomic<uint64_t> maxNs;
+};
+
+// times the enclosing scope and records it in that stage's histogram
+struct StageTimer {
+	int stage;
+	int64 startTicks;
+	StageTimer(int myStage) : stage(myStage), startTicks(getTickCount()) {}
+	~StageTimer();
+};
+
+// frames buffered between two pipeline stages
+#define RINGSIZE 4
+
+// bounded lock-free queue of frames between pipeline stages
+// (Vyukov's bounded MPMC queue). pushFrame and popFrame swap Mat headers
+// with the caller, so the preallocated frame buffers circulate between
+// the stages and are never copied or reallocated.
+struct FrameRing {
+	Mat frames[RINGSIZE];
+	std::atomic<size_t> seq[RINGSIZE]; // slot state, see pushFrame/popFrame
+	std::atomic<size_t> head; // next push position
+	std::atomic<size_t> tail; // next pop position
+	std::atomic<int> nDropped; // frames thrown away to make room
+};
+
+// functions timed by -bench
+enum {
+	BENCH_CVTINRANGE, // cvtColor and 3 inRange calls
+	BENCH_ERODE,
+	BENCH_RECTS, // getThresholdRects
+	BENCH_DILATE, // dilateRects
+	BENCH_PAIRING, // pairColorCodes for the 3 codes
+	BENCH_BBOXHSV, // getBoundingBoxHSV
+	BENCH_DETECTBLOBS, // single channel detectBlobs
+	BENCH_DETECTCC, // whole detectCCBlobs
+	NBENCH
+};
+#define BENCHPIXELS 50000000 // pixels each benchmark processes, sets the iterations
+#define PAIRALLPAIRSMAX 256 // getCCRectBinary tests all pairs up to this many (A x B)
+
+// counts Mat buffer allocations for -bench and tracking, memory comes
+// from the standard allocator
+struct CountingMatAllocator : public MatAllocator {
+	UMatData* allocate(int dims, const int* sizes, int type, void* data, size_t* step, int flags, UMatUsageFlags usageFlags) const;
+	bool allocate(UMatData* data, int accessFlags, UMatUsageFlags usageFlags) const;
+	void deallocate(UMatData* data) const;
+};
+
+// where the frames come from
+#define SOURCE_CAMERA 0
+#define SOURCE_VIDEO 1 // video file
+#define SOURCE_IMAGES 2 // directory of images, read in file name order
+#define SOURCE_RAW 3 // file of raw BGR frames back to back
+#define SOURCE_SYNTH 4 // generated color code markers with ground truth
+#define SOURCE_V4L2 5 // V4L2 camera streaming YUYV, NV12 or MJPEG into mmap'd buffers
+#define SOURCE_YUYV 6 // file of raw YUYV frames back to back
+#define SOURCE_NV12 7 // file of raw NV12 frames back to back
+#define SOURCE_I420 8 // file of raw I420 frames back to back
+#define SOURCE_MJPEG 9 // file of JPEG frames back to back
+
+#define V4L2NBUFFERS 4 // driver buffers requested by a V4L2 source
+#define V4L2MAXBUFFERS 32 // VIDEO_MAX_FRAME, the most a driver may hand out instead
+#define V4L2DEFAULTWIDTH 640
+#define V4L2DEFAULTHEIGHT 480
+
+#define NSYNTHNOISE 4 // noise frames precomputed and cycled by the generator
+#define MAXSYNTHCODES 64 // color codes the generator can draw
+
+// moving color code markers drawn by the synthetic frame generator
+struct SyntheticScene {
+	Size frameSize;
+	int nCodes;
+	int markerSize; // side of each of the 2 squares of a marker [px]
+	int maxRotation; // markers swing up to this angle [deg]
+	int noise; // amplitude of the uniform pixel noise
+	int blurSize; // Gaussian blur kernel, 0 for none
+	int drift; // illumination swings by this much [%]
+	int nDistractors; // single color blobs that are not color codes
+	Scalar channelColors[3]; // BGR at the middle of each channel's HSV range
+	vector<Point2f> positions; // markers first, then distractors
+	vector<Point2f> velocities;
+	vector<float> phases; // rotation phase of each marker
+	Mat noiseFrames[NSYNTHNOISE];
+	int frameIndex;
+	Rect truthRects[MAXSYNTHCODES]; // bounding rect of each marker in the last frame
+	int nTruthRects;
+};
+
+// H, S and V histograms of the calibration box, kept up to date as
+// the box is dragged
+struct CalibHistogram {
+	int validFlag; // 0 to start again from an empty box
+	int channel; // channel being calibrated
+	Rect box; // pixels counted
+	int counts[3][256];
+	Mat samples; // HSV of each counted pixel as it was counted, to take it out again
+};
+
+// thresholds loaded by -reload, with the lookup tables built for them.
+// Written by the watcher only while no processing thread reads it
+struct ThresholdSet {
+	int MIN[3][3];
+	int MAX[3][3];
+	vector<uchar> colorLUT;
+	vector<uchar> yuvLUT;
+	int version; // thresholdVersion when it was made active
+	std::atomic<int> nReaders; // processing threads copying it
+};
+
+#if defined(HAVE_JPEG)
+// libjpeg error handler state, errors jump back into decodeJPEG
+struct JpegErrorManager {
+	struct jpeg_error_mgr pub;
+	jmp_buf jump;
+};
+#endif
+
+// camera or recorded input, optionally paced to its frame rate
+struct FrameSource {
+	int type;
+	VideoCapture capture; // SOURCE_CAMERA, SOURCE_VIDEO
+	vector<String> files; // SOURCE_IMAGES
+	size_t nextFile;
+	FILE *rawFile; // SOURCE_RAW, SOURCE_YUYV, SOURCE_NV12, SOURCE_I420, SOURCE_MJPEG
+	Size rawSize; // all but SOURCE_CAMERA, SOURCE_VIDEO and SOURCE_IMAGES
+	int v4l2Fd; // SOURCE_V4L2, -1 when closed
+	uint32_t v4l2Format; // V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_NV12 or V4L2_PIX_FMT_MJPEG
+	uchar *v4l2Buffers[V4L2MAXBUFFERS]; // mmap'd driver buffers
+	size_t v4l2Lengths[V4L2MAXBUFFERS];
+	int v4l2NBuffers;
+	int v4l2Stride; // bytes per row
+	int v4l2Held; // buffer handed out as the last frame, requeued at the next read, -1 if none
+	int zeroCopyFlag; // the last frame is done with before the next read, so YUYV frames may be the driver buffers
+	Mat readBuffer; // YUYV or NV12 frame read before conversion to BGR
+	vector<uchar> chromaPlanes; // SOURCE_I420, U and V planes before interleaving
+	vector<uchar> jpegData; // SOURCE_MJPEG, the JPEG of the frame being read
+	Rect decodeRegion; // -jpegroi, part of the next MJPEG frame to decode, empty for all of it
+#if defined(HAVE_JPEG)
+	struct jpeg_decompress_struct jpegDecoder; // created at the first MJPEG frame
+	JpegErrorManager jpegErrors;
+	int jpegCreatedFlag;
+#endif
+	double fps; // frame rate the recording is paced to
+	int64 nextFrameTicks; // when the next frame is due when paced
+	int nSkipped; // frames skipped to keep up when paced
+	SyntheticScene scene; // SOURCE_SYNTH
+};
+
+// persistent worker threads that share the tasks of one runParallel call
+struct ThreadPool {
+	vector<std::thread> workers;
+	std::mutex lock;
+	std::condition_variable wake; // a new batch of tasks or quit
+	std::condition_variable done; // the batch has finished
+	void (*taskFunc)(void *arg, int task);
+	void *taskArg;
+	int nTasks;
+	int nextTask; // next task index to hand out
+	int nPending; // tasks not finished yet
+	int nActive; // workers holding the current batch
+	unsigned generation; // incremented for each batch
+	int quitFlag;
+};
+
+struct TrackerScratch;
+
+// one search window's work, shared by its per-channel tasks
+struct ChannelJob {
+	Rect region;
+	int (*MINHSV)[3];
+	int (*MAXHSV)[3];
+	int dilateFactor;
+	Mat hsv; // view of imgHSV the size of the window
+	Mat thresh[3]; // views of imgThreshCh1..3 the size of the window
+	vector<Rect> *rects[3];
+	TrackerScratch *scratch; // buffers of the thread that set up the job
+	int scale; // frame pixels per mask pixel each way, 2 for 4:2:0 frames
+	int threshMode; // THRESH_*, read by the pool's threads
+};
+
+// constant velocity Kalman filter following one color code. x and y
+// are filtered separately, each with state (position, velocity)
+struct CCTrack {
+	int activeFlag; // 1 while the code is being followed
+	double pos[2]; // centre x, y [px]
+	double vel[2]; // [px/frame]
+	double cov[2][3]; // per axis covariance: pos-pos, pos-vel, vel-vel
+	Size size; // last detected width and height
+	int nMissed; // frames since the last detection
+	Rect window; // predicted search window for the current frame
+};
+
+// per-channel buffers of the tracking loop, kept between frames
+struct ChannelScratch {
+	vector<Rect> rects; // rects of the current search window
+	vector<BlobInfo> blobs;
+	vector<BlobRun> prevRuns, curRuns; // labelBlobs
+	vector<int> parent;
+	vector<BlobInfo> stats;
+	vector<uchar> erodeRows; // erodeMask
+};
+
+// buffers detectCCBlobs reuses every frame. They are cleared, never
+// freed, so once they have grown to the largest frame seen the
+// tracking loop makes no operator new or Mat allocations
+struct TrackerScratch {
+	vector<Rect> filteredRects[3]; // dilated rects of each channel
+	vector<Rect> searchRegions;
+	vector<CCMatch> chosen; // pairs taken by pairColorCodes
+	vector<CCMatch> matches; // every instance, with -multi
+	vector<int> usedRects[3];
+	vector<uchar> thresholdRows; // thresholdErode3
+	Mat yuyvBGR; // frame sized, YUYV windows converted for inRange mode
+	Mat coarseBGR, coarseHSV, coarseThresh[3]; // -pyramid
+	vector<Rect> coarseRects[3];
+	vector<CCMatch> coarsePairs;
+	ChannelScratch channels[3]; // one each, the channels run in parallel
+};
+#define ALLOCWARMUPFRAMES 30 // frames before tracking allocations are counted
+
+// what tracking keeps from one frame of an input to the next
+struct TrackerState {
+	CCTrack ccTracks[3]; // motion of each color code, predicts the search windows
+	int trackLostFlag; // a tracked color code was missed, search whole frame next
+	int framesSinceFullSearch;
+	int frameCount; // frames processed
+	int camera; // index of the input
+};
+
+#define MAXCAMERAS 16 // inputs tracked at once
+
+// one of several inputs tracked at once. Its capture thread queues
+// frames that any worker of the shared pool may process, one at a time
+struct CameraInput {
+	FrameSource source;
+	FrameRing frames; // captured, not processed yet
+	TrackerState tracker;
+	Mat frame; // frame being processed
+	std::thread captureThread;
+	std::atomic<int> busyFlag; // a worker is processing this input
+	std::atomic<int> captureDoneFlag; // the capture thread has queued its last frame
+	std::atomic<int> doneFlag; // every frame has been processed
+	std::atomic<int> nProcessed; // frames processed, read by the rate report
+	int64 startTicks; // when capture started
+	std::atomic<int64> stopTicks; // when the last frame was processed, 0 until then
+};
+
+// set by keys and the mouse, on the display thread with -pipeline, and
+// read by the processing thread once per frame
 int mouseDraggedFlag = 0; // detects mouse dragged event
-int trackModeFlag = 1; // keeps track of whether calibrating (0) or tracking (1)
-int channelFlag = 0; // keeps track of current channel being calibrated
+std::atomic<int> trackModeFlag(1); // keeps track of whether calibrating (0) or tracking (1)
+std::atomic<int> channelFlag(0); // keeps track of current channel being calibrated
 char charCheckForKey = 0;
 int BBOX[4] = {0,0,1,1}; // bounding box for calibration x1,y1,x2,y2
-int frameCount = 0; // keeps track of frame count
-Mat imgOriginal;		// input image
-Mat imgHSV;
-Mat imgThresh;
-Mat imgThreshCh1;
-Mat imgThreshCh2;
-Mat imgThreshCh3;
+std::mutex bboxLock; // BBOX is copied whole, never read half dragged
+CalibHistogram calibHistogram; // pixels of BBOX
+double calibPercentile = CALIBPERCENTILE; // -calibpct
+std::atomic<int> threshModeFlag(THRESH_FUSED); // keeps track of thresholding method
+std::atomic<int> roiModeFlag(0); // search only around last frame's color codes (1) or whole frame (0)
+TrackerState mainTracker; // state of the only input
+thread_local TrackerState *tracker = &mainTracker; // state of the input the thread is processing
+int nChannelThreads = 1; // threads running the per-channel stages (1 = serial)
+ThreadPool channelPool;
+int pipelineFlag = 0; // run capture, processing and display on separate threads
+int dropOldestFlag = 0; // when a stage falls behind, drop its oldest queued frame (1) or wait (0)
+std::atomic<int> quitFlag(0); // tells the pipeline threads to finish
+std::atomic<int> captureDoneFlag(0); // the capture thread has queued its last frame
+const char *inputSpecs[MAXCAMERAS]; // -in, camera 0 if not given
+int nInputs = 0;
+CameraInput *cameraInputs = NULL; // with several inputs, while they are tracked
+int realtimeFlag = 0; // pace recorded input to its frame rate (1) or read it as fast as possible (0)
+double inputFps = 0; // -fps, overrides the frame rate of recorded input
+FILE *truthFile = NULL; // -truth, ground truth of generated frames
+int benchFlag = 0; // run the benchmark sweep instead of tracking
+std::atomic<uint64_t> nHeapAllocs(0); // operator new calls
+std::atomic<uint64_t> nMatAllocs(0); // Mat buffers allocated while counting
+CountingMatAllocator countingMatAllocator;
+thread_local TrackerScratch trackerScratch; // per thread, so any worker can process any input
+std::atomic<uint64_t> trackHeapAllocs(0); // operator new calls made by tracking after the warm-up
+std::atomic<uint64_t> trackMatAllocs(0); // Mat buffers allocated by tracking after the warm-up
+std::atomic<int> trackAllocFrames(0); // frames those were counted over
+const char *benchNames[NBENCH] = {"cvtColor+inRange", "erode", "getThresholdRects", "dilateRects", "pairColorCodes", "getBoundingBoxHSV", "detectBlobs", "detectCCBlobs"};
+int headlessFlag = 0; // no windows or drawing, detections are printed instead
+int multiCCFlag = 0; // report every instance of each color code (1) or the largest (0)
+int pyramidScale = 1; // -pyramid, 1 to search full frames at full resolution
+int jpegScale = 1; // -jpegscale, MJPEG frames are decoded at 1/jpegScale size
+int jpegRoiFlag = 0; // -jpegroi, decode only the search windows of MJPEG frames (1) or whole frames (0)
+int globalAssignFlag = 1; // share channel rects between codes by a global assignment (1) or code by code in code order (0)
+thread_local AssignSearch assignSearch;
+int resultSinkFlag = SINK_NONE; // where the per-frame results go
+char *resultSinkPath = NULL; // file or shared memory name of the sink
+FILE *resultFile = NULL; // binary sink
+ShmResultRing *resultShm = NULL; // shared memory sink
+thread_local FrameResult frameResult; // results of the current frame
+std::mutex resultLock; // one record at a time goes to the sink
+double startTicks = 0; // getTickCount at startup
+StageHistogram stageHistograms[NSTAGES];
+const char *stageNames[NSTAGES] = {"capture", "coarse", "cvtColor", "inRange ch1", "inRange ch2", "inRange ch3", "threshold", "erode", "getThresholdRects", "dilateRects", "getCCRectBinary", "render", "frame"};
+volatile sig_atomic_t dumpStatsFlag = 0; // set by SIGUSR1, dump the histograms at the next frame
+thread_local Mat imgOriginal;		// input image
+thread_local Mat imgHSV;
+thread_local Mat imgThresh;
+thread_local Mat imgThreshCh1;
+thread_local Mat imgThreshCh2;
+thread_local Mat imgThreshCh3;
+// per thread, as each thread adopts reloaded thresholds at its own frame boundary
+thread_local vector<uchar> colorLUT; // BGR to channel bitmask (bit 0 ch1, bit 1 ch2, bit 2 ch3)
+thread_local vector<uchar> yuvLUT; // YUV to channel bitmask, indexed like colorLUT
+thread_local int lutMIN[3][3]; // thresholds colorLUT was built from
+thread_local int lutMAX[3][3];
+thread_local int lutValidFlag = 0; // colorLUT has been built
+int reloadFlag = 0; // -reload, watch the config file for new thresholds
+ThresholdSet thresholdSets[2]; // double buffer of reloaded thresholds
+std::atomic<int> activeThresholdSet(0); // the set processing threads copy from
+std::atomic<int> thresholdVersion(0); // bumped by every reload, 0 until the first
+thread_local int seenThresholdVersion = 0; // reload the thread's thresholds come from
+// threshModeFlag and roiModeFlag as of the start of the thread's frame
+thread_local int frameThreshMode = THRESH_FUSED;
+thread_local int frameRoiMode = 0;
+std::thread configWatcherThread;
+std::atomic<int> watcherQuitFlag(0); // tells the watcher to finish
 
 static void onMouse(int event, int x, int y, int f, void*);
 int getChannelFlag(char charKey);
-void getBoundingBoxHSV(Mat myImgHSV, int BOX[], int HSVMIN[], int HSVMAX[]);
-void getThresholdRects(Mat myImgThresh, vector<Rect> &filteredRect);
+void getBoundingBoxHSV(Mat myImgHSV, int BOX[], int channel, int HSVMIN[], int HSVMAX[]);
+void updateCalibHistogram(Mat myImgHSV, Rect box);
+void countHistogramSpan(const uchar *src, uchar *copy, int x0, int x1, int sign, int counts[][256]);
+int getPercentileValue(const int counts[], int rank);
+void getThresholdRects(Mat myImgThresh, vector<Rect> &filteredRect, Point offset, int scale, ChannelScratch &scratch);
+int labelBlobs(Mat myImgThresh, vector<BlobInfo> &blobs, Point offset, ChannelScratch &scratch);
+void erodeMask(Mat src, Mat &dst, vector<uchar> &rowBuf);
 void detectCCBlobs(int MINHSV[][3], int MAXHSV[][3]);
+void reserveTrackerScratch(TrackerScratch &scratch);
+int getSearchRegions(Size frameSize, vector<Rect> &regions);
+void mergeSearchRegions(Size frameSize, vector<Rect> &regions);
+void getCoarseRegions(int MINHSV[][3], int MAXHSV[][3], int dilateFactor, vector<Rect> &regions);
+Size getFrameSize(Mat &frame);
+void getRegionRects(Rect region, int MINHSV[][3], int MAXHSV[][3], int dilateFactor, vector<Rect> &rectsCh1, vector<Rect> &rectsCh2, vector<Rect> &rectsCh3);
+void processChannel(void *arg, int ch);
+void predictCCTracks(Size frameSize);
+void updateCCTracks(Rect ccRects[], int foundFlags[], int fullSearchFlag);
+void thresholdHSV3(Mat myImgHSV, int MINHSV[][3], int MAXHSV[][3], Mat &myThresh1, Mat &myThresh2, Mat &myThresh3);
+void getHSVBounds(int MINHSV[][3], int MAXHSV[][3], uchar lo[][3], uchar hi[][3]);
+void thresholdHSV3Row(const uchar *src, int cols, uchar lo[][3], uchar hi[][3], uchar *dst[3]);
+void updateColorLUT(int MINHSV[][3], int MAXHSV[][3]);
+void buildColorLUTs(int MINHSV[][3], int MAXHSV[][3], vector<uchar> &bgrTable, vector<uchar> &yuvTable);
+void packChannelLUT(Mat lutHSV, int step, int MINHSV[][3], int MAXHSV[][3], vector<uchar> &lut);
+void thresholdLUTRow(const uchar *src, int cols, const uchar *lut, uchar *dst[3]);
+void thresholdYUYVRow(const uchar *src, int cols, uchar *dst[3]);
+void thresholdNV12Row(const uchar *luma0, const uchar *luma1, const uchar *chroma, int cols, uchar *dst[3]);
+void thresholdErode3(Mat mySrc, Mat myChroma, int srcType, int MINHSV[][3], int MAXHSV[][3], Mat &myThresh1, Mat &myThresh2, Mat &myThresh3, vector<uchar> &rowBuf);
 void dilateRects(int factor, vector<Rect> &myRect);
-int getCCRectBinary(vector<Rect> &rectsChA, vector<Rect> &rectsChB, vector<int> &usedA, vector<int> &usedB, Rect ccRects[], int code);
+int getCCRectBinary(vector<Rect> &rectsChA, vector<Rect> &rectsChB, vector<int> &usedA, vector<int> &usedB, Rect ccRects[], int ccParts[][2], int code);
+int getCCRectBinaryAllPairs(vector<Rect> &rectsChA, vector<Rect> &rectsChB, vector<int> &usedA, vector<int> &usedB, Rect ccRects[], int ccParts[][2], int code);
+int getCCRectsAll(vector<Rect> &rectsChA, vector<Rect> &rectsChB, vector<int> &usedA, vector<int> &usedB, vector<CCMatch> &matches, int code);
+void getOverlapPairs(vector<Rect> &rectsChA, vector<Rect> &rectsChB, vector<int> &usedA, vector<int> &usedB, vector<CCMatch> &pairs, int code);
+void pairColorCodes(vector<Rect> *codeRects[][2], Rect ccRects[], int ccParts[][2], int foundFlags[], vector<CCMatch> &matches);
+void assignCCGlobal(vector<Rect> *codeRects[][2], vector<CCMatch> &chosen);
+void searchAssignSingle(int code, int64_t weight);
+void searchAssignMulti(int e, int64_t weight, int64_t sumLeft, int64_t sumNodes);
+void solveAssignment(int n, vector<int64_t> &cost, vector<int> &rowToCol);
 void detectBlobs(int MINHSV[], int MAXHSV[]);
+void startThreadPool(ThreadPool &pool, int nThreads);
+void stopThreadPool(ThreadPool &pool);
+void runParallel(ThreadPool &pool, int nTasks, void (*func)(void *arg, int task), void *arg);
+void threadPoolWorker(ThreadPool *pool);
+int parseArgs(int argc, char* argv[]);
+void handleKey(char charKey);
+void onSignal(int sig);
+void fillFrameResult(Rect ccRects[], int foundFlags[], int ccParts[][2], vector<Rect> *codeRects[][2], vector<CCMatch> &matches);
+void fillCCResult(CCResult &cc, Rect ccRect, Rect a, Rect b);
+int openResultSink();
+void closeResultSink();
+void emitFrameResult(FrameResult &result);
+void recordStageTime(int stage, int64 ticks);
+void dumpStageHistograms();
+uint64_t getHistogramPercentile(StageHistogram &hist, uint64_t nSamples, double percentile);
+void runBenchmarks();
+void benchmarkFrame(const char *label, Mat &frame, int MINHSV[][3], int MAXHSV[][3], int nCodes);
+void runBenchFunction(int func, Mat &frame, int MINHSV[][3], int MAXHSV[][3], vector<Rect> rects[], vector<Rect> &workRects, Mat &workThresh);
+int initSyntheticScene(SyntheticScene &scene, const char *spec, int MINHSV[][3], int MAXHSV[][3]);
+void drawSyntheticFrame(SyntheticScene &scene, Mat &frame);
+void benchmarkPairing();
+void writeGroundTruth(SyntheticScene &scene);
+void closeGroundTruth();
+void processFrame(int HSVMINALL[][3], int HSVMAXALL[][3]);
+int openFrameSource(FrameSource &source, const char *spec);
+int readFrame(FrameSource &source, Mat &frame);
+int skipFrame(FrameSource &source);
+void closeFrameSource(FrameSource &source);
+void runPipeline(FrameSource &source, int HSVMINALL[][3], int HSVMAXALL[][3]);
+void captureLoop(FrameSource *source, FrameRing *ringOut, std::atomic<int> *doneFlag);
+int runMultiCamera(int HSVMINALL[][3], int HSVMAXALL[][3]);
+void cameraWorker(int worker, int (*HSVMINALL)[3], int (*HSVMAXALL)[3]);
+void dumpInputRates();
+void processLoop(FrameRing *ringIn, FrameRing *ringOut, int (*HSVMINALL)[3], int (*HSVMAXALL)[3]);
+void initFrameRing(FrameRing &ring, Size frameSize, int type);
+int pushFrame(FrameRing &ring, Mat &frame);
+int popFrame(FrameRing &ring, Mat &frame);
+void putFrame(FrameRing &ring, Mat &frame);
+int openV4L2Source(FrameSource &source, const char *device, int width, int height, uint32_t format);
+int readV4L2Frame(FrameSource &source, Mat &frame);
+int xioctl(int fd, unsigned long request, void *arg);
+int readJPEGData(FILE *file, vector<uchar> &data);
+int decodeJPEG(FrameSource &source, const uchar *data, size_t size, Mat &frame);
+#if defined(HAVE_JPEG)
+void onJPEGError(j_common_ptr info);
+#endif
+Rect getDecodeRegion(Size frameSize);
 int loadConfigFile(int MIN[][3], int MAX[][3], int nChannels);
+int readConfigFile(int MIN[][3], int MAX[][3], int nChannels);
+int startConfigWatcher();
+void stopConfigWatcher();
+void configWatcher(int fd);
+void publishThresholds(int MIN[][3], int MAX[][3]);
+int refreshThresholds(int MIN[][3], int MAX[][3], int &version);
 int saveConfigFile(int MIN[][3], int MAX[][3], int nChannels);
 
 int main(int argc, char* argv[]) {
-	double ticks = (double)getTickCount();
-	cv::VideoCapture capWebcam(0);		// declare a VideoCapture object and associate to webcam, 0 => use 1st webcam
-	if (capWebcam.isOpened() == false) {				// check if VideoCapture object was associated to webcam successfully
-		std::cout << "error: capWebcam not accessed successfully\n\n";	// if not, print error message to std out
-		return(0);														// and exit program
+	startTicks = (double)getTickCount();
+	if (parseArgs(argc, argv) != 0) {
+		return(1);
 	}
+	if (benchFlag == 1) {
+		if (nChannelThreads > 1) {
+			startThreadPool(channelPool, nChannelThreads - 1); // the calling thread works too
+		}
+		runBenchmarks();
+		stopThreadPool(channelPool);
+		closeGroundTruth();
+		return(0);
+	}
+	if (openResultSink() != 0) {
+		closeGroundTruth();
+		return(1);
+	}
+	Mat::setDefaultAllocator(&countingMatAllocator); // for the tracking allocation count
 
 	int HSVMAX[3] = { 0, 0, 0 };
 	int HSVMIN[3] = { 255,255,255 };
 	int HSVMAXALL[3][3] = {{0,0,0}, {0,0,0}, {0,0,0}}; // HSV for 3 channels // HSV max thresh for all channesl
 	int HSVMINALL[3][3] = {{255, 255, 255}, {255, 255, 255}, {255, 255, 255}}; // HSV min thresh for 3 channels
 	loadConfigFile(HSVMINALL,HSVMAXALL,3); // save HSV thresholds to config file
+	if (reloadFlag == 1 && startConfigWatcher() != 0) {
+		closeResultSink();
+		closeGroundTruth();
+		return(1);
+	}
+
+	if (nInputs > 1) { // headless, stopped by the end of the inputs or a signal
+		signal(SIGINT, onSignal);
+		signal(SIGTERM, onSignal);
+		signal(SIGUSR1, onSignal);
+		int status = runMultiCamera(HSVMINALL, HSVMAXALL);
+		stopConfigWatcher();
+		closeGroundTruth();
+		if (status != 0) {
+			closeResultSink();
+			return(1);
+		}
+		int loadedVersion = 0; // the workers tracked with copies, keep the last reload
+		refreshThresholds(HSVMINALL, HSVMAXALL, loadedVersion);
+		closeResultSink();
+		saveConfigFile(HSVMINALL,HSVMAXALL,3);
+		return(0);
+	}
+	FrameSource frameSource;		// 1st webcam unless -in names a recording
+	if (openFrameSource(frameSource, inputSpecs[0]) != 0) {				// check if the input was opened successfully
+		std::cerr << "error: input not accessed successfully\n\n";	// if not, print error message to std err
+		stopConfigWatcher();
+		closeResultSink();
+		closeGroundTruth();
+		return(1);														// and exit program
+	}
+	// started once nothing can fail, every later path stops it
+	if (nChannelThreads > 1) {
+		startThreadPool(channelPool, nChannelThreads - 1); // the calling thread works too
+	}
+	frameSource.zeroCopyFlag = pipelineFlag == 0; // each frame is processed before the next is read
+
+	if (headlessFlag == 1) {
+		// no keys to quit with, stop cleanly on Ctrl-C or kill
+		signal(SIGINT, onSignal);
+		signal(SIGTERM, onSignal);
+		signal(SIGUSR1, onSignal); // dump stage latencies
+	} else {
+		// declare windows
+		namedWindow("imgOriginal", CV_WINDOW_AUTOSIZE);	// note: you can use CV_WINDOW_NORMAL which allows resizing the window
+		//namedWindow("imgThresh", CV_WINDOW_AUTOSIZE);	// or CV_WINDOW_AUTOSIZE for a fixed size window matching the resolution of the image
+														// CV_WINDOW_AUTOSIZE is the default
+		//namedWindow("imgHSV", CV_WINDOW_AUTOSIZE);
+		//set the callback function for any mouse event
+		setMouseCallback("imgOriginal", onMouse, NULL);
+	}
+
+	int64 runTicks = getTickCount();
+	if (pipelineFlag == 1) {
+		runPipeline(frameSource, HSVMINALL, HSVMAXALL);
+	}
+	while (pipelineFlag == 0 && charCheckForKey != 27 && quitFlag == 0) {		// until the Esc key is pressed or the input ends
+		handleKey(charCheckForKey);
+		int frameStatus;
+		if (jpegRoiFlag == 1) { // imgOriginal still holds the last frame
+			frameSource.decodeRegion = trackModeFlag == 1 ? getDecodeRegion(getFrameSize(imgOriginal)) : Rect();
+		}
+		{
+			StageTimer timer(STAGE_CAPTURE);
+			frameStatus = readFrame(frameSource, imgOriginal);		// get next frame
+		}
+		if (frameStatus != 0) {		// if frame not read successfully
+			break;					// jump out of while loop
+		}
+		processFrame(HSVMINALL, HSVMAXALL);
+		if (headlessFlag == 0) {
+			{
+				StageTimer timer(STAGE_RENDER);
+				imshow("imgOriginal", imgOriginal);			// show windows
+				//imshow("imgThresh", imgThresh);
+			}
+			charCheckForKey = waitKey(1);			// delay (in ms) and get key press, if any
+		}
+	}	// end while
+	if (frameSource.type != SOURCE_CAMERA && frameSource.type != SOURCE_V4L2) {
+		double seconds = (getTickCount() - runTicks)/getTickFrequency();
+		fprintf(stderr, "%d frames in %.3f s (%.1f fps), %d skipped to keep real time\n", mainTracker.frameCount, seconds, mainTracker.frameCount/seconds, frameSource.nSkipped);
+	}
+	stopConfigWatcher(); // before the thresholds are saved, which would trigger it
+	closeFrameSource(frameSource);
+	closeGroundTruth();
+	stopThreadPool(channelPool);
+	dumpStageHistograms();
+	closeResultSink();
+	saveConfigFile(HSVMINALL,HSVMAXALL,3); // save HSV thresholds to config file
+	return(0);
+}
+
+
+/// @brief Act on a key pressed in the color window
+///
+/// @param charKey char key pressed
+///
+/// @return Void
+///
+void handleKey(char charKey) {
+
+	if(getChannelFlag(charKey) != 99) {
+		channelFlag = getChannelFlag(charKey);
+	}
+	if(charKey == 'f') { // cycle thresholding method to compare frame times
+		int threshMode = (threshModeFlag + 1) % 3;
+		threshModeFlag = threshMode;
+		fprintf(stderr, "threshold mode %s\n", threshMode == THRESH_INRANGE ? "inRange" : (threshMode == THRESH_FUSED ? "fused" : "LUT"));
+	}
+	if(charKey == 'r') { // toggle ROI tracking
+		int roiMode = !roiModeFlag;
+		roiModeFlag = roiMode;
+		fprintf(stderr, "ROI tracking %s\n", roiMode ? "on" : "off");
+	}
+	if(charKey == 'h') { // dump stage latencies
+		dumpStatsFlag = 1;
+	}
+}
+
+
+/// @brief Signal handler that asks the main loop to finish
+///
+/// @param sig signal number
+///
+/// @return Void
+///
+void onSignal(int sig) {
+	if (sig == SIGUSR1) {
+		dumpStatsFlag = 1;
+	} else {
+		quitFlag = 1;
+	}
+}
+
+
+/// @brief Calibrate or track on imgOriginal, drawing the results into it
+///
+/// In headless mode nothing is drawn and the detections are printed.
+/// Thresholds reloaded since the last frame (-reload) are copied into
+/// HSVMINALL and HSVMAXALL first.
+///
+/// @param HSVMINALL minimum HSV thresholds for 3 channels [H S V]
+/// @param HSVMAXALL maximum HSV thresholds for 3 channels [H S V]
+///
+/// @return Void
+///
+void processFrame(int HSVMINALL[][3], int HSVMAXALL[][3]) {
+
+	StageTimer timer(STAGE_FRAME);
+	if (dumpStatsFlag == 1) {
+		dumpStatsFlag = 0;
+		dumpStageHistograms();
+	}
+	refreshThresholds(HSVMINALL, HSVMAXALL, seenThresholdVersion);
+	// the mode, channel and box may change on the display thread meanwhile
+	int trackMode = trackModeFlag;
+	int channel = channelFlag;
+	if (trackMode == 0) { // calibration mode
+		int box[4];
+		{
+			std::lock_guard<std::mutex> guard(bboxLock);
+			memcpy(box, BBOX, sizeof(box));
+		}
+		cvtColor(imgOriginal, imgHSV, CV_BGR2HSV);
+		getBoundingBoxHSV(imgHSV, box, channel, HSVMINALL[channel], HSVMAXALL[channel]);
+		// bounding box	to show selected color region
+		rectangle(imgOriginal,
+			Point(box[0], box[1]),
+			Point(box[2], box[3]),
+			Scalar(200, 200, 200),
+			1,
+			8);
+		putText(imgOriginal, "CAL", Point(30,30), FONT_HERSHEY_PLAIN , 1.5, Scalar(12, 12, 200), 2, 8, false); // indicate tracking mode
+
+	} else if (trackMode == 1) { // tracking mode
+									 // do vision processing here
+		uint64_t heapStart = nHeapAllocs.load(std::memory_order_relaxed);
+		uint64_t matStart = nMatAllocs.load(std::memory_order_relaxed);
+		detectCCBlobs(HSVMINALL, HSVMAXALL);
+		if (tracker->frameCount >= ALLOCWARMUPFRAMES) { // buffers have grown by now
+			trackHeapAllocs += nHeapAllocs.load(std::memory_order_relaxed) - heapStart;
+			trackMatAllocs += nMatAllocs.load(std::memory_order_relaxed) - matStart;
+			trackAllocFrames++;
+		}
+		if (headlessFlag == 0) {
+			StageTimer timer(STAGE_RENDER);
+			putText(imgOriginal, "TRACK", Point(30,30), FONT_HERSHEY_PLAIN , 1.5, Scalar(12, 12, 200), 2, 8, false); // indicate tracking mode
+		}
+	}
+	if (headlessFlag == 0 && tracker->frameCount % 60 == 0) {
+		fprintf(stderr, "HSVMAX %d %d %d HSVMIN %d %d %d\n ch %d\n", HSVMAXALL[channel][0], HSVMAXALL[channel][1], HSVMAXALL[channel][2], HSVMINALL[channel][0], HSVMINALL[channel][1], HSVMINALL[channel][2], channel+1);
+	}
+	tracker->frameCount++;
+}
+
+
+/// @brief Run capture, processing and display as a 3 stage pipeline
+///
+/// A capture thread and a processing thread are started and the calling
+/// thread displays frames and handles keys (HighGUI needs to stay on
+/// one thread). The stages are linked by FrameRings, so throughput is
+/// limited by the slowest stage rather than the sum of all three.
+/// Returns when Esc is pressed or the camera stops delivering frames.
+///
+/// @param source opened camera or recording
+/// @param HSVMINALL minimum HSV thresholds for 3 channels [H S V]
+/// @param HSVMAXALL maximum HSV thresholds for 3 channels [H S V]
+///
+/// @return Void
+///
+void runPipeline(FrameSource &source, int HSVMINALL[][3], int HSVMAXALL[][3]) {
+
+	FrameRing capturedFrames, processedFrames;
+	Mat displayFrame;
+	// first frame gives the size to preallocate the rings with
+	if (readFrame(source, displayFrame) != 0) {
+		return;
+	}
+	initFrameRing(capturedFrames, displayFrame.size(), displayFrame.type());
+	initFrameRing(processedFrames, displayFrame.size(), displayFrame.type());
+	quitFlag = 0;
+	captureDoneFlag = 0;
+	putFrame(capturedFrames, displayFrame); // the first frame is processed too
+	std::thread captureThread(captureLoop, &source, &capturedFrames, &captureDoneFlag);
+	std::thread processThread(processLoop, &capturedFrames, &processedFrames, HSVMINALL, HSVMAXALL);
+
+	while (quitFlag == 0) {
+		if (headlessFlag == 1) { // nothing to display, wait for a signal
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			continue;
+		}
+		if (popFrame(processedFrames, displayFrame) == 0) {
+			StageTimer timer(STAGE_RENDER);
+			imshow("imgOriginal", displayFrame);
+		}
+		charCheckForKey = waitKey(1);
+		if (charCheckForKey == 27) {
+			quitFlag = 1;
+		}
+		handleKey(charCheckForKey);
+	}
+	captureThread.join();
+	processThread.join();
+	dumpStatsFlag = 0;
+	fprintf(stderr, "dropped %d captured and %d processed frames\n", (int)capturedFrames.nDropped, (int)processedFrames.nDropped);
+}
+
 
-	// declare windows
-	namedWindow("imgOriginal", CV_WINDOW_AUTOSIZE);	// note: you can use CV_WINDOW_NORMAL which allows resizing the window
-	//namedWindow("imgThresh", CV_WINDOW_AUTOSIZE);	// or CV_WINDOW_AUTOSIZE for a fixed size window matching the resolution of the image
-													// CV_WINDOW_AUTOSIZE is the default
-	//namedWindow("imgHSV", CV_WINDOW_AUTOSIZE);
-	//set the callback function for any mouse event
-	setMouseCallback("imgOriginal", onMouse, NULL);
+/// @brief Capture stage: read frames into the ring until told to quit
+/// or the input ends
+///
+/// @param source opened camera or recording
+/// @param ringOut ring the frames are queued on
+/// @param doneFlag set once the last frame is queued
+///
+/// @return Void
+///
+void captureLoop(FrameSource *source, FrameRing *ringOut, std::atomic<int> *doneFlag) {
+
+	// the buffer handed back and forth with the ring. Slot 0 may already
+	// be popped, the last slot is not touched until this thread fills it
+	Mat frame = ringOut->frames[RINGSIZE - 1].clone();
+	while (quitFlag == 0) {
+		int frameStatus;
+		{
+			StageTimer timer(STAGE_CAPTURE);
+			frameStatus = readFrame(*source, frame);
+		}
+		if (frameStatus != 0) {
+			break;
+		}
+		putFrame(*ringOut, frame);
+	}
+	*doneFlag = 1; // the processing stage drains the ring, then quits
+}
+
+
+/// @brief Processing stage: calibrate or track every queued frame and
+/// queue it for display
+///
+/// @param ringIn ring of captured frames
+/// @param ringOut ring of processed frames
+/// @param HSVMINALL minimum HSV thresholds for 3 channels [H S V]
+/// @param HSVMAXALL maximum HSV thresholds for 3 channels [H S V]
+///
+/// @return Void
+///
+void processLoop(FrameRing *ringIn, FrameRing *ringOut, int (*HSVMINALL)[3], int (*HSVMAXALL)[3]) {
+
+	// imgOriginal is thread_local, so it is preallocated here. The last
+	// slot of ringOut is not touched until this thread fills it
+	imgOriginal.create(ringOut->frames[RINGSIZE - 1].size(), ringOut->frames[RINGSIZE - 1].type());
+	while (quitFlag == 0) {
+		int lastFrameFlag = captureDoneFlag; // read before popping so the last frame is not missed
+		if (popFrame(*ringIn, imgOriginal) != 0) {
+			if (lastFrameFlag == 1) {
+				break;
+			}
+			std::this_thread::sleep_for(std::chrono::microseconds(200));
+			continue;
+		}
+		processFrame(HSVMINALL, HSVMAXALL);
+		if (headlessFlag == 0) {
+			putFrame(*ringOut, imgOriginal);
+		}
+	}
+	quitFlag = 1;
+}
+
+
+/// @brief Track several inputs at once on a shared pool of workers
+///
+/// Every input gets a capture thread queueing its frames on its own
+/// FrameRing, and its own TrackerState. The calling thread and
+/// nWorkers-1 more run cameraWorker until every input has ended or
+/// quitFlag is set. The per-frame buffers (imgOriginal, imgHSV,
+/// trackerScratch, ...) are thread_local, so whichever worker takes an
+/// input's frame tracks it with the input's state.
+///
+/// @param HSVMINALL minimum HSV thresholds for 3 channels [H S V]
+/// @param HSVMAXALL maximum HSV thresholds for 3 channels [H S V]
+///
+/// @return 0 if successful, 1 if an input could not be opened
+///
+int runMultiCamera(int HSVMINALL[][3], int HSVMAXALL[][3]) {
+
+	int i, nOpened;
+	int nWorkers = nChannelThreads > 1 ? nChannelThreads : (int)std::thread::hardware_concurrency();
+	if (nWorkers < 1) {
+		nWorkers = 1;
+	}
+	CameraInput *inputs = new CameraInput[nInputs](); // zeroed tracker state and flags
+	for (nOpened = 0; nOpened < nInputs; nOpened++) {
+		CameraInput &input = inputs[nOpened];
+		// first frame gives the size to preallocate the ring with
+		if (openFrameSource(input.source, inputSpecs[nOpened]) != 0 || readFrame(input.source, input.frame) != 0) {
+			fprintf(stderr, "error: input %s not accessed successfully\n", inputSpecs[nOpened]);
+			break;
+		}
+		input.tracker.camera = nOpened;
+		initFrameRing(input.frames, input.frame.size(), input.frame.type());
+		putFrame(input.frames, input.frame); // the first frame is processed too
+	}
+	if (nOpened < nInputs) {
+		for (i = 0; i <= nOpened && i < nInputs; i++) {
+			closeFrameSource(inputs[i].source);
+		}
+		delete[] inputs;
+		return 1;
+	}
+	quitFlag = 0;
+	cameraInputs = inputs;
+	int64 runTicks = getTickCount();
+	for (i = 0; i < nInputs; i++) {
+		inputs[i].startTicks = runTicks;
+		inputs[i].captureThread = std::thread(captureLoop, &inputs[i].source, &inputs[i].frames, &inputs[i].captureDoneFlag);
+	}
+	vector<std::thread> workers;
+	for (i = 1; i < nWorkers; i++) {
+		workers.push_back(std::thread(cameraWorker, i, HSVMINALL, HSVMAXALL));
+	}
+	cameraWorker(0, HSVMINALL, HSVMAXALL); // the calling thread works too
+	for (i = 0; i < (int)workers.size(); i++) {
+		workers[i].join();
+	}
+	quitFlag = 1; // stops capture threads still running after Ctrl-C
+	for (i = 0; i < nInputs; i++) {
+		inputs[i].captureThread.join();
+		closeFrameSource(inputs[i].source);
+	}
+	fprintf(stderr, "%d inputs on %d workers\n", nInputs, nWorkers);
+	dumpStageHistograms(); // with the frame rates
+	cameraInputs = NULL;
+	delete[] inputs;
+	return 0;
+}
+
+
+/// @brief Worker of runMultiCamera: process queued frames of any input
+/// until every input has ended or quitFlag is set
+///
+/// Each round starts at the worker's own input (worker % nInputs) and
+/// goes round the others, processing one queued frame of every input
+/// not being processed by another worker. With a worker per input,
+/// workers mostly stay with their own input and steal frames from the
+/// others when it has none queued, and fewer workers than inputs still
+/// serve every input in turn. An input is claimed with busyFlag for one
+/// frame at a time, which keeps its frames in order and its
+/// TrackerState consistent without a lock. Each worker tracks with its
+/// own copy of the thresholds, which -reload updates between frames.
+///
+/// @param worker index of the worker
+/// @param HSVMINALL minimum HSV thresholds for 3 channels [H S V]
+/// @param HSVMAXALL maximum HSV thresholds for 3 channels [H S V]
+///
+/// @return Void
+///
+void cameraWorker(int worker, int (*HSVMINALL)[3], int (*HSVMAXALL)[3]) {
+
+	int k;
+	int MINHSV[3][3], MAXHSV[3][3];
+	memcpy(MINHSV, HSVMINALL, sizeof(MINHSV));
+	memcpy(MAXHSV, HSVMAXALL, sizeof(MAXHSV));
+	while (quitFlag == 0) {
+		int nDone = 0, processedFlag = 0;
+		for (k = 0; k < nInputs; k++) {
+			CameraInput &input = cameraInputs[(worker + k) % nInputs];
+			int idle = 0;
+			if (input.doneFlag == 1) {
+				nDone++;
+				continue;
+			}
+			if (!input.busyFlag.compare_exchange_strong(idle, 1, std::memory_order_acquire)) {
+				continue;
+			}
+			int lastFrameFlag = input.captureDoneFlag; // read before popping so the last frame is not missed
+			if (popFrame(input.frames, input.frame) == 0) {
+				tracker = &input.tracker;
+				imgOriginal = input.frame; // header only, the worker's buffer is not touched
+				processFrame(MINHSV, MAXHSV);
+				imgOriginal.release();
+				input.nProcessed++;
+				processedFlag = 1;
+			} else if (lastFrameFlag == 1) {
+				input.stopTicks = getTickCount();
+				input.doneFlag = 1;
+				nDone++;
+			}
+			input.busyFlag.store(0, std::memory_order_release);
+		}
+		if (nDone == nInputs) {
+			break;
+		}
+		if (processedFlag == 0) { // nothing queued anywhere
+			std::this_thread::sleep_for(std::chrono::microseconds(200));
+		}
+	}
+	tracker = &mainTracker;
+}
+
+
+/// @brief Print the frame rate of every input tracked at once and of
+/// all of them together, to stderr
+///
+/// Inputs still running are rated up to now.
+///
+/// @return Void
+///
+void dumpInputRates() {
+
+	int i, nTotal = 0;
+	int64 now = getTickCount();
+	int64 firstStart = now, lastStop = 0;
+	for (i = 0; i < nInputs; i++) {
+		CameraInput &input = cameraInputs[i];
+		int64 stop = input.stopTicks != 0 ? (int64)input.stopTicks : now;
+		double seconds = (stop - input.startTicks)/getTickFrequency();
+		int n = input.nProcessed;
+		fprintf(stderr, "input %d %s: %d frames in %.3f s (%.1f fps), %d dropped, %d skipped to keep real time\n", i, inputSpecs[i],
+				n, seconds, seconds > 0 ? n/seconds : 0.0, (int)input.frames.nDropped, input.source.nSkipped);
+		nTotal += n;
+		firstStart = std::min(firstStart, input.startTicks);
+		lastStop = std::max(lastStop, stop);
+	}
+	double seconds = (lastStop - firstStart)/getTickFrequency();
+	fprintf(stderr, "all inputs: %d frames in %.3f s (%.1f fps)\n", nTotal, seconds, seconds > 0 ? nTotal/seconds : 0.0);
+}
+
+
+/// @brief Open the camera or recording frames are read from
+///
+/// SPEC is cam:N or N for camera N, raw:WxH:PATH for a file of raw
+/// 8-bit BGR frames of WxH pixels, v4l2:[WxH:]DEVICE for a V4L2 camera
+/// captured as YUYV, v4l2:[WxH:]nv12:DEVICE for one captured as NV12,
+/// v4l2:[WxH:]mjpeg:DEVICE for one captured as MJPEG,
+/// yuyv:WxH:PATH, nv12:WxH:PATH and i420:WxH:PATH for files of raw
+/// YUYV, NV12 and I420 frames, mjpeg:PATH for a file of JPEG frames,
+/// synth:N,... for N generated color code markers (see
+/// initSyntheticScene), a directory of images (png, jpg, bmp, ppm)
+/// read in file name order, or else a video file.
+///
+/// @param source frame source to set up
+/// @param spec input description, NULL for camera 0
+///
+/// @return 0 if successful, 1 if the input could not be opened
+///
+int openFrameSource(FrameSource &source, const char *spec) {
+
+	struct stat pathInfo;
+	int width, height, nChars = 0;
+	source.nextFile = 0;
+	source.rawFile = NULL;
+	source.fps = 0;
+	source.nextFrameTicks = 0;
+	source.nSkipped = 0;
+	source.v4l2Fd = -1;
+	source.v4l2NBuffers = 0;
+	source.v4l2Held = -1;
+	source.zeroCopyFlag = 0;
+	source.decodeRegion = Rect();
+#if defined(HAVE_JPEG)
+	source.jpegCreatedFlag = 0;
+#else
+	if (spec != NULL && (strncmp(spec, "mjpeg:", 6) == 0 || strstr(spec, ":mjpeg:") != NULL)) {
+		fprintf(stderr, "MJPEG input needs libjpeg, build with -DHAVE_JPEG and link -ljpeg\n");
+		return 1;
+	}
+#endif
+	if (spec != NULL && strncmp(spec, "v4l2:", 5) == 0) {
+		source.type = SOURCE_V4L2;
+		const char *device = spec + 5;
+		width = V4L2DEFAULTWIDTH;
+		height = V4L2DEFAULTHEIGHT;
+		if (sscanf(spec, "v4l2:%dx%d:%n", &width, &height, &nChars) == 2 && nChars > 0) {
+			device = spec + nChars;
+		}
+		if (strncmp(device, "nv12:", 5) == 0) {
+			return openV4L2Source(source, device + 5, width, height, V4L2_PIX_FMT_NV12);
+		}
+		if (strncmp(device, "mjpeg:", 6) == 0) {
+			return openV4L2Source(source, device + 6, width, height, V4L2_PIX_FMT_MJPEG);
+		}
+		return openV4L2Source(source, device, width, height, V4L2_PIX_FMT_YUYV);
+	}
+	if (spec == NULL || strncmp(spec, "cam:", 4) == 0 || strspn(spec, "0123456789") == strlen(spec)) {
+		source.type = SOURCE_CAMERA;
+		source.capture.open(spec == NULL ? 0 : atoi(spec[0] == 'c' ? spec + 4 : spec));
+		return source.capture.isOpened() ? 0 : 1;
+	}
+	if (strncmp(spec, "synth:", 6) == 0) {
+		// marker colors from the configured channel thresholds
+		int MINHSV[3][3] = {{255, 255, 255}, {255, 255, 255}, {255, 255, 255}};
+		int MAXHSV[3][3] = {{0, 0, 0}, {0, 0, 0}, {0, 0, 0}};
+		source.type = SOURCE_SYNTH;
+		loadConfigFile(MINHSV, MAXHSV, 3);
+		if (initSyntheticScene(source.scene, spec + 6, MINHSV, MAXHSV) != 0) {
+			fprintf(stderr, "bad synthetic input %s\n", spec);
+			return 1;
+		}
+		source.fps = 60;
+	} else if (sscanf(spec, "raw:%dx%d:%n", &width, &height, &nChars) == 2 && nChars > 0) {
+		source.type = SOURCE_RAW;
+		source.rawSize = Size(width, height);
+		source.rawFile = fopen(spec + nChars, "rb");
+		source.fps = 30;
+	} else if (sscanf(spec, "yuyv:%dx%d:%n", &width, &height, &nChars) == 2 && nChars > 0) {
+		source.type = SOURCE_YUYV;
+		source.rawSize = Size(width, height);
+		source.rawFile = fopen(spec + nChars, "rb");
+		source.fps = 30;
+		if (width % 2 != 0) { // pixels come in pairs sharing U and V
+			fprintf(stderr, "YUYV frames need an even width\n");
+			return 1;
+		}
+	} else if ((sscanf(spec, "nv12:%dx%d:%n", &width, &height, &nChars) == 2 || sscanf(spec, "i420:%dx%d:%n", &width, &height, &nChars) == 2) && nChars > 0) {
+		source.type = spec[0] == 'n' ? SOURCE_NV12 : SOURCE_I420;
+		source.rawSize = Size(width, height);
+		source.rawFile = fopen(spec + nChars, "rb");
+		source.fps = 30;
+		if (width % 2 != 0 || height % 2 != 0) { // 2x2 pixels share U and V
+			fprintf(stderr, "4:2:0 frames need an even width and height\n");
+			return 1;
+		}
+	} else if (strncmp(spec, "mjpeg:", 6) == 0) {
+		source.type = SOURCE_MJPEG;
+		source.rawFile = fopen(spec + 6, "rb");
+		source.fps = 30;
+	} else if (stat(spec, &pathInfo) == 0 && S_ISDIR(pathInfo.st_mode)) {
+		source.type = SOURCE_IMAGES;
+		vector<String> names;
+		size_t i;
+		glob(String(spec) + "/*", names, false); // sorted by name
+		for (i = 0; i < names.size(); i++) {
+			String ext = names[i].substr(names[i].find_last_of('.') + 1);
+			for (size_t j = 0; j < ext.size(); j++) {
+				ext[j] = (char)tolower(ext[j]);
+			}
+			if (ext == "png" || ext == "jpg" || ext == "jpeg" || ext == "bmp" || ext == "ppm") {
+				source.files.push_back(names[i]);
+			}
+		}
+		source.fps = 30;
+	} else {
+		source.type = SOURCE_VIDEO;
+		source.capture.open(String(spec));
+		source.fps = source.capture.get(CV_CAP_PROP_FPS);
+	}
+	if (inputFps > 0) {
+		source.fps = inputFps;
+	}
+	if (source.fps <= 0) {
+		source.fps = 30;
+	}
+	if (source.type == SOURCE_RAW || source.type == SOURCE_YUYV || source.type == SOURCE_NV12 || source.type == SOURCE_I420) {
+		return source.rawFile != NULL && width > 0 && height > 0 ? 0 : 1;
+	}
+	if (source.type == SOURCE_MJPEG) {
+		return source.rawFile != NULL ? 0 : 1;
+	}
+	if (source.type == SOURCE_IMAGES) {
+		return source.files.empty() ? 1 : 0;
+	}
+	if (source.type == SOURCE_SYNTH) {
+		return 0;
+	}
+	return source.capture.isOpened() ? 0 : 1;
+}
+
+
+/// @brief Get the next frame from a frame source
+///
+/// With -realtime, recorded input is paced to its frame rate and, like
+/// a camera that keeps running, frames are skipped when processing
+/// falls more than a frame behind.
+///
+/// Headless, V4L2 and YUV file sources deliver YUYV (CV_8UC2) or
+/// 4:2:0 frames in the NV12 layout (CV_8UC1, see getFrameSize) that
+/// are thresholded as they are. With a window they are converted to
+/// BGR for drawing. MJPEG frames are decoded to BGR (decodeJPEG), and
+/// corrupt ones are dropped.
+///
+/// @param source opened frame source
+/// @param frame frame read, reuses its buffer when the size matches
+///
+/// @return 0 if successful, 1 at the end of the input or on error
+///
+int readFrame(FrameSource &source, Mat &frame) {
+
+	if (source.type == SOURCE_CAMERA) {
+		if (!source.capture.read(frame) || frame.empty()) {
+			std::cerr << "error: frame not read from webcam\n";
+			return 1;
+		}
+		return 0;
+	}
+	if (source.type == SOURCE_V4L2) {
+		return readV4L2Frame(source, frame);
+	}
+	if (realtimeFlag == 1) {
+		int64 framePeriod = (int64)(getTickFrequency()/source.fps);
+		int64 now = getTickCount();
+		if (source.nextFrameTicks == 0) {
+			source.nextFrameTicks = now;
+		}
+		while (now - source.nextFrameTicks > framePeriod) {
+			if (skipFrame(source) != 0) {
+				return 1;
+			}
+			source.nSkipped++;
+			source.nextFrameTicks += framePeriod;
+		}
+		if (now < source.nextFrameTicks) {
+			std::this_thread::sleep_for(std::chrono::microseconds((int64)((source.nextFrameTicks - now)*1e6/getTickFrequency())));
+		}
+		source.nextFrameTicks += framePeriod;
+	}
+	if (source.type == SOURCE_VIDEO) {
+		return source.capture.read(frame) && !frame.empty() ? 0 : 1;
+	}
+	if (source.type == SOURCE_SYNTH) {
+		drawSyntheticFrame(source.scene, frame);
+		writeGroundTruth(source.scene);
+		return 0;
+	}
+	if (source.type == SOURCE_RAW) {
+		frame.create(source.rawSize, CV_8UC3);
+		return fread(frame.data, frame.elemSize(), frame.total(), source.rawFile) == frame.total() ? 0 : 1;
+	}
+	if (source.type == SOURCE_YUYV) {
+		Mat &yuyv = headlessFlag == 1 ? frame : source.readBuffer;
+		yuyv.create(source.rawSize, CV_8UC2);
+		if (fread(yuyv.data, yuyv.elemSize(), yuyv.total(), source.rawFile) != yuyv.total()) {
+			return 1;
+		}
+		if (headlessFlag == 0) {
+			cvtColor(yuyv, frame, CV_YUV2BGR_YUYV);
+		}
+		return 0;
+	}
+	if (source.type == SOURCE_NV12 || source.type == SOURCE_I420) {
+		int width = source.rawSize.width, height = source.rawSize.height;
+		size_t chromaBytes = (size_t)width*height/2;
+		Mat &nv12 = headlessFlag == 1 ? frame : source.readBuffer;
+		nv12.create(height*3/2, width, CV_8UC1);
+		if (fread(nv12.data, 1, (size_t)width*height, source.rawFile) != (size_t)width*height) {
+			return 1;
+		}
+		if (source.type == SOURCE_NV12) {
+			if (fread(nv12.ptr<uchar>(height), 1, chromaBytes, source.rawFile) != chromaBytes) {
+				return 1;
+			}
+		} else {
+			size_t i;
+			source.chromaPlanes.resize(chromaBytes);
+			if (fread(&source.chromaPlanes[0], 1, chromaBytes, source.rawFile) != chromaBytes) {
+				return 1;
+			}
+			const uchar *u = &source.chromaPlanes[0];
+			const uchar *v = u + chromaBytes/2;
+			uchar *uv = nv12.ptr<uchar>(height);
+			for (i = 0; i < chromaBytes/2; i++) {
+				uv[2*i] = u[i];
+				uv[2*i + 1] = v[i];
+			}
+		}
+		if (headlessFlag == 0) {
+			cvtColor(nv12, frame, CV_YUV2BGR_NV12);
+		}
+		return 0;
+	}
+	if (source.type == SOURCE_MJPEG) {
+		while (readJPEGData(source.rawFile, source.jpegData) == 0) {
+			if (decodeJPEG(source, &source.jpegData[0], source.jpegData.size(), frame) == 0) {
+				return 0;
+			}
+		}
+		return 1;
+	}
+	while (source.nextFile < source.files.size()) {
+		Mat image = imread(source.files[source.nextFile++]);
+		if (!image.empty()) {
+			image.copyTo(frame);
+			return 0;
+		}
+		std::cerr << "error: could not read " << source.files[source.nextFile - 1] << "\n";
+	}
+	return 1;
+}
+
+
+/// @brief Step over the next frame of a recording without decoding it
+/// where possible
+///
+/// @param source opened recorded frame source
+///
+/// @return 0 if successful, 1 at the end of the input
+///
+int skipFrame(FrameSource &source) {
+
+	if (source.type == SOURCE_VIDEO) {
+		return source.capture.grab() ? 0 : 1;
+	}
+	if (source.type == SOURCE_RAW || source.type == SOURCE_YUYV || source.type == SOURCE_NV12 || source.type == SOURCE_I420) {
+		long frameBytes = (long)source.rawSize.area()*(source.type == SOURCE_RAW ? 6 : (source.type == SOURCE_YUYV ? 4 : 3))/2;
+		return fseek(source.rawFile, frameBytes, SEEK_CUR) == 0 && !feof(source.rawFile) ? 0 : 1;
+	}
+	if (source.type == SOURCE_MJPEG) {
+		return readJPEGData(source.rawFile, source.jpegData);
+	}
+	if (source.type == SOURCE_SYNTH) { // the markers keep moving
+		source.scene.frameIndex++;
+		return 0;
+	}
+	if (source.nextFile < source.files.size()) {
+		source.nextFile++;
+		return 0;
+	}
+	return 1;
+}
+
+
+/// @brief Release the camera, video or file behind a frame source
+///
+/// @param source frame source
+///
+/// @return Void
+///
+void closeFrameSource(FrameSource &source) {
+
+	int i;
+	source.capture.release();
+	if (source.v4l2Fd >= 0) {
+		enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		xioctl(source.v4l2Fd, VIDIOC_STREAMOFF, &type);
+		for (i = 0; i < source.v4l2NBuffers; i++) {
+			munmap(source.v4l2Buffers[i], source.v4l2Lengths[i]);
+		}
+		close(source.v4l2Fd);
+		source.v4l2Fd = -1;
+		source.v4l2NBuffers = 0;
+		source.v4l2Held = -1;
+	}
+	if (source.rawFile != NULL) {
+		fclose(source.rawFile);
+		source.rawFile = NULL;
+	}
+#if defined(HAVE_JPEG)
+	if (source.jpegCreatedFlag == 1) {
+		jpeg_destroy_decompress(&source.jpegDecoder);
+		source.jpegCreatedFlag = 0;
+	}
+#endif
+}
+
+
+/// @brief Open a V4L2 camera and start it streaming YUYV, NV12 or MJPEG
+/// frames into mmap'd driver buffers
+///
+/// The driver may pick a size close to the one asked for, rawSize
+/// gets the size it picked.
+///
+/// @param source frame source to set up
+/// @param device device node, e.g. /dev/video0
+/// @param width frame width asked for
+/// @param height frame height asked for
+/// @param pixelFormat V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_NV12 or V4L2_PIX_FMT_MJPEG
+///
+/// @return 0 if successful, 1 if the device could not be opened or
+/// does not stream that format
+///
+int openV4L2Source(FrameSource &source, const char *device, int width, int height, uint32_t pixelFormat) {
+
+	int i;
+	struct v4l2_format format;
+	struct v4l2_requestbuffers request;
+	source.v4l2Format = pixelFormat;
+	source.v4l2Fd = open(device, O_RDWR);
+	if (source.v4l2Fd < 0) {
+		fprintf(stderr, "could not open %s\n", device);
+		return 1;
+	}
+	memset(&format, 0, sizeof(format));
+	format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	format.fmt.pix.width = width;
+	format.fmt.pix.height = height;
+	format.fmt.pix.pixelformat = pixelFormat;
+	format.fmt.pix.field = V4L2_FIELD_NONE;
+	if (xioctl(source.v4l2Fd, VIDIOC_S_FMT, &format) != 0 || format.fmt.pix.pixelformat != pixelFormat) {
+		fprintf(stderr, "%s does not capture %s\n", device, pixelFormat == V4L2_PIX_FMT_NV12 ? "NV12" : (pixelFormat == V4L2_PIX_FMT_MJPEG ? "MJPEG" : "YUYV"));
+		closeFrameSource(source);
+		return 1;
+	}
+	source.rawSize = Size(format.fmt.pix.width, format.fmt.pix.height);
+	source.v4l2Stride = format.fmt.pix.bytesperline;
+	memset(&request, 0, sizeof(request));
+	request.count = V4L2NBUFFERS;
+	request.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	request.memory = V4L2_MEMORY_MMAP;
+	if (xioctl(source.v4l2Fd, VIDIOC_REQBUFS, &request) != 0 || request.count < 2) {
+		fprintf(stderr, "%s has no mmap buffers\n", device);
+		closeFrameSource(source);
+		return 1;
+	}
+	// the driver may raise the count to its own minimum
+	int nBuffers = std::min((int)request.count, V4L2MAXBUFFERS);
+	for (i = 0; i < nBuffers; i++) {
+		struct v4l2_buffer buffer;
+		memset(&buffer, 0, sizeof(buffer));
+		buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		buffer.memory = V4L2_MEMORY_MMAP;
+		buffer.index = i;
+		if (xioctl(source.v4l2Fd, VIDIOC_QUERYBUF, &buffer) != 0) {
+			break;
+		}
+		void *mem = mmap(NULL, buffer.length, PROT_READ | PROT_WRITE, MAP_SHARED, source.v4l2Fd, buffer.m.offset);
+		if (mem == MAP_FAILED) {
+			break;
+		}
+		source.v4l2Buffers[i] = (uchar*)mem;
+		source.v4l2Lengths[i] = buffer.length;
+		source.v4l2NBuffers++;
+		if (xioctl(source.v4l2Fd, VIDIOC_QBUF, &buffer) != 0) {
+			break;
+		}
+	}
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	if (i < nBuffers || xioctl(source.v4l2Fd, VIDIOC_STREAMON, &type) != 0) {
+		fprintf(stderr, "%s could not start streaming\n", device);
+		closeFrameSource(source);
+		return 1;
+	}
+	return 0;
+}
+
+
+/// @brief Wait for the next frame of a V4L2 camera
+///
+/// The buffer handed out by the previous call is given back to the
+/// driver first. With zeroCopyFlag, headless frames are headers on the
+/// driver buffer, so nothing is copied; otherwise the frame is copied
+/// (headless, YUYV or NV12) or converted (BGR) out of it and the buffer
+/// goes straight back to the driver. The UV plane of an NV12 buffer
+/// follows the luma rows at the same stride. MJPEG buffers are decoded
+/// (decodeJPEG) and given straight back, and a frame that does not
+/// decode is dropped for the next one.
+///
+/// @param source opened V4L2 frame source
+/// @param frame frame read
+///
+/// @return 0 if successful, 1 on error
+///
+int readV4L2Frame(FrameSource &source, Mat &frame) {
+
+	struct v4l2_buffer buffer;
+	memset(&buffer, 0, sizeof(buffer));
+	buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buffer.memory = V4L2_MEMORY_MMAP;
+	if (source.v4l2Held >= 0) {
+		buffer.index = source.v4l2Held;
+		source.v4l2Held = -1;
+		if (xioctl(source.v4l2Fd, VIDIOC_QBUF, &buffer) != 0) {
+			std::cerr << "error: buffer not given back to the camera\n";
+			return 1;
+		}
+	}
+	while (source.v4l2Format == V4L2_PIX_FMT_MJPEG && quitFlag == 0) {
+		if (xioctl(source.v4l2Fd, VIDIOC_DQBUF, &buffer) != 0) {
+			std::cerr << "error: frame not read from camera\n";
+			return 1;
+		}
+		int decodeStatus = decodeJPEG(source, source.v4l2Buffers[buffer.index], buffer.bytesused, frame);
+		if (xioctl(source.v4l2Fd, VIDIOC_QBUF, &buffer) != 0) {
+			std::cerr << "error: buffer not given back to the camera\n";
+			return 1;
+		}
+		if (decodeStatus == 0) {
+			return 0;
+		}
+	}
+	if (source.v4l2Format == V4L2_PIX_FMT_MJPEG) { // stopped while frames did not decode
+		return 1;
+	}
+	if (xioctl(source.v4l2Fd, VIDIOC_DQBUF, &buffer) != 0) { // blocks until a frame is in
+		std::cerr << "error: frame not read from camera\n";
+		return 1;
+	}
+	int nv12Flag = source.v4l2Format == V4L2_PIX_FMT_NV12;
+	Mat yuv(nv12Flag ? source.rawSize.height*3/2 : source.rawSize.height, source.rawSize.width, nv12Flag ? CV_8UC1 : CV_8UC2,
+			source.v4l2Buffers[buffer.index], source.v4l2Stride);
+	if (headlessFlag == 1 && source.zeroCopyFlag == 1) {
+		frame = yuv;
+		source.v4l2Held = buffer.index;
+		return 0;
+	}
+	if (headlessFlag == 1) {
+		yuv.copyTo(frame);
+	} else {
+		cvtColor(yuv, frame, nv12Flag ? CV_YUV2BGR_NV12 : CV_YUV2BGR_YUYV);
+	}
+	return xioctl(source.v4l2Fd, VIDIOC_QBUF, &buffer) == 0 ? 0 : 1;
+}
+
+
+/// @brief ioctl, retried when interrupted by a signal
+///
+/// @param fd device
+/// @param request ioctl request
+/// @param arg request argument
+///
+/// @return 0 if successful, -1 on error
+///
+int xioctl(int fd, unsigned long request, void *arg) {
+
+	int status;
+	do {
+		status = ioctl(fd, request, arg);
+	} while (status == -1 && errno == EINTR);
+	return status;
+}
+
+
+/// @brief Read the next JPEG of a file of JPEG frames back to back
+///
+/// Bytes before a start of image marker are skipped. Marker segments
+/// are copied by their length, so an embedded thumbnail does not end
+/// the frame, and entropy coded data runs to the next marker that is
+/// not a restart marker. The frame ends at its end of image marker.
+///
+/// @param file file of JPEG frames
+/// @param data gets the JPEG, reuses its buffer
+///
+/// @return 0 if successful, 1 at the end of the file or on a cut off frame
+///
+int readJPEGData(FILE *file, vector<uchar> &data) {
+
+	int c, prev = 0, marker = 0, length, i;
+	data.clear();
+	while ((c = getc(file)) != EOF && !(prev == 0xFF && c == 0xD8)) {
+		prev = c;
+	}
+	if (c == EOF) {
+		return 1;
+	}
+	data.push_back(0xFF);
+	data.push_back(0xD8);
+	while (1) {
+		if (marker == 0) {
+			if (getc(file) != 0xFF) {
+				return 1;
+			}
+			while ((marker = getc(file)) == 0xFF) { // fill bytes
+			}
+			if (marker == EOF) {
+				return 1;
+			}
+		}
+		data.push_back(0xFF);
+		data.push_back((uchar)marker);
+		if (marker == 0xD9) { // end of image
+			return 0;
+		}
+		int lengthHi = getc(file);
+		int lengthLo = getc(file);
+		if (lengthLo == EOF) {
+			return 1;
+		}
+		data.push_back((uchar)lengthHi);
+		data.push_back((uchar)lengthLo);
+		length = (lengthHi << 8 | lengthLo) - 2;
+		for (i = 0; i < length && (c = getc(file)) != EOF; i++) {
+			data.push_back((uchar)c);
+		}
+		if (i < length) {
+			return 1;
+		}
+		if (marker != 0xDA) {
+			marker = 0;
+			continue;
+		}
+		// start of scan, its entropy coded data stuffs every 0xFF data byte with a 0
+		marker = 0;
+		prev = 0;
+		while ((c = getc(file)) != EOF) {
+			if (prev == 0xFF && c != 0 && c != 0xFF && (c < 0xD0 || c > 0xD7)) {
+				data.pop_back(); // the 0xFF of the marker
+				marker = c;
+				break;
+			}
+			data.push_back((uchar)c);
+			prev = c;
+		}
+		if (c == EOF) {
+			return 1;
+		}
+	}
+}
+
+
+/// @brief Decode a JPEG frame to BGR at 1/jpegScale size
+///
+/// libjpeg scales in the DCT domain, with an inverse DCT of 1/jpegScale
+/// size per block, so the dropped pixels are never computed. With a
+/// decodeRegion, scanlines above it are skipped, decoding stops below
+/// it and only the iMCU columns across it are dequantized, transformed
+/// and color converted. The rest of the frame keeps its old pixels.
+/// The entropy coded data of the skipped part is still read.
+///
+/// @param source frame source, holds the decoder and decodeRegion
+/// @param data JPEG
+/// @param size bytes of JPEG
+/// @param frame gets the decoded frame, reuses its buffer when the size matches
+///
+/// @return 0 if successful, 1 if the JPEG is corrupt
+///
+int decodeJPEG(FrameSource &source, const uchar *data, size_t size, Mat &frame) {
+
+#if defined(HAVE_JPEG)
+	struct jpeg_decompress_struct &decoder = source.jpegDecoder;
+	if (source.jpegCreatedFlag == 0) {
+		decoder.err = jpeg_std_error(&source.jpegErrors.pub);
+		source.jpegErrors.pub.error_exit = onJPEGError;
+		jpeg_create_decompress(&decoder);
+		source.jpegCreatedFlag = 1;
+	}
+	if (setjmp(source.jpegErrors.jump) != 0) {
+		jpeg_abort_decompress(&decoder);
+		return 1;
+	}
+	jpeg_mem_src(&decoder, data, size);
+	jpeg_read_header(&decoder, TRUE);
+	decoder.scale_num = 1;
+	decoder.scale_denom = jpegScale;
+	decoder.out_color_space = JCS_EXT_BGR;
+	jpeg_start_decompress(&decoder);
+	frame.create(decoder.output_height, decoder.output_width, CV_8UC3);
+	Rect region = source.decodeRegion & Rect(0, 0, frame.cols, frame.rows);
+	if (region.area() == 0) {
+		region = Rect(0, 0, frame.cols, frame.rows);
+	}
+	JDIMENSION x = region.x, width = region.width;
+	if (region.width < frame.cols) {
+		jpeg_crop_scanline(&decoder, &x, &width); // widened to whole iMCUs
+	}
+	if (region.y > 0) {
+		jpeg_skip_scanlines(&decoder, region.y);
+	}
+	while (decoder.output_scanline < (JDIMENSION)(region.y + region.height)) {
+		JSAMPROW row = frame.ptr<uchar>(decoder.output_scanline) + 3*x;
+		jpeg_read_scanlines(&decoder, &row, 1);
+	}
+	jpeg_abort_decompress(&decoder); // the scanlines below are not needed
+	return 0;
+#else
+	(void)source;
+	(void)data;
+	(void)size;
+	(void)frame;
+	return 1;
+#endif
+}
+
+
+#if defined(HAVE_JPEG)
+/// @brief libjpeg error handler, reports the error and jumps back into
+/// decodeJPEG instead of exiting
+///
+/// @param info decoder
+///
+/// @return Void
+///
+void onJPEGError(j_common_ptr info) {
+
+	char message[JMSG_LENGTH_MAX];
+	(*info->err->format_message)(info, message);
+	std::cerr << "error: frame not decoded, " << message << "\n";
+	longjmp(((JpegErrorManager*)info->err)->jump, 1);
+}
+#endif
+
+
+/// @brief Get the part of the next frame tracking will look at, for
+/// -jpegroi
+///
+/// The search window prediction of detectCCBlobs is run on a copy of
+/// the tracker state, so the tracks only move on when the frame is
+/// processed.
+///
+/// @param frameSize size of the last frame
+///
+/// @return bounding rect of the search windows, empty when the whole
+/// frame will be searched
+///
+Rect getDecodeRegion(Size frameSize) {
+
+	size_t i;
+	static thread_local vector<Rect> regions;
+	TrackerState savedTracker = *tracker;
+	predictCCTracks(frameSize);
+	int fullSearchFlag = getSearchRegions(frameSize, regions);
+	*tracker = savedTracker;
+	if (fullSearchFlag == 1) {
+		return Rect();
+	}
+	Rect bounds = regions[0];
+	for (i = 1; i < regions.size(); i++) {
+		bounds |= regions[i];
+	}
+	return bounds;
+}
+
+
+/// @brief Set up an empty ring with every slot holding a preallocated frame
+///
+/// @param ring frame ring
+/// @param frameSize size of the frames
+/// @param type OpenCV type of the frames
+///
+/// @return Void
+///
+void initFrameRing(FrameRing &ring, Size frameSize, int type) {
+
+	int i;
+	for (i = 0; i < RINGSIZE; i++) {
+		ring.frames[i].create(frameSize, type);
+		ring.seq[i].store(i, std::memory_order_relaxed);
+	}
+	ring.head.store(0, std::memory_order_relaxed);
+	ring.tail.store(0, std::memory_order_relaxed);
+	ring.nDropped.store(0, std::memory_order_relaxed);
+}
+
+
+/// @brief Queue a frame without blocking
+///
+/// A slot's sequence number equals its position when the slot is free
+/// for that push and position+1 once it holds a frame. The frame is
+/// swapped into the slot, so the caller gets the slot's old buffer back
+/// to fill next.
+///
+/// @param ring frame ring
+/// @param frame frame to queue, replaced by a free buffer
+///
+/// @return 0 if queued, 1 if the ring is full
+///
+int pushFrame(FrameRing &ring, Mat &frame) {
+
+	size_t pos = ring.head.load(std::memory_order_relaxed);
+	while (1) {
+		size_t slot = pos % RINGSIZE;
+		long dif = (long)ring.seq[slot].load(std::memory_order_acquire) - (long)pos;
+		if (dif == 0) {
+			if (ring.head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+				cv::swap(ring.frames[slot], frame);
+				ring.seq[slot].store(pos + 1, std::memory_order_release);
+				return 0;
+			}
+		} else if (dif < 0) {
+			return 1;
+		} else {
+			pos = ring.head.load(std::memory_order_relaxed);
+		}
+	}
+}
+
+
+/// @brief Take the oldest queued frame without blocking
+///
+/// The slot's sequence number becomes position+RINGSIZE, freeing it for
+/// the push one lap later.
+///
+/// @param ring frame ring
+/// @param frame gets the frame, its old buffer goes back into the ring
+///
+/// @return 0 if a frame was taken, 1 if the ring is empty
+///
+int popFrame(FrameRing &ring, Mat &frame) {
+
+	size_t pos = ring.tail.load(std::memory_order_relaxed);
+	while (1) {
+		size_t slot = pos % RINGSIZE;
+		long dif = (long)ring.seq[slot].load(std::memory_order_acquire) - (long)(pos + 1);
+		if (dif == 0) {
+			if (ring.tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+				cv::swap(ring.frames[slot], frame);
+				ring.seq[slot].store(pos + RINGSIZE, std::memory_order_release);
+				return 0;
+			}
+		} else if (dif < 0) {
+			return 1;
+		} else {
+			pos = ring.tail.load(std::memory_order_relaxed);
+		}
+	}
+}
+
+
+/// @brief Queue a frame, applying the drop policy when the ring is full
+///
+/// With dropOldestFlag the oldest queued frame is thrown away to make
+/// room, so the next stage always works on recent frames. Otherwise the
+/// caller waits for the next stage to take a frame. The producer is the
+/// only one pushing, so the slot freed by the drop is the one the push
+/// fills, and the dropped frame's buffer is handed back to the caller.
+///
+/// @param ring frame ring
+/// @param frame frame to queue, replaced by a free buffer
+///
+/// @return Void
+///
+void putFrame(FrameRing &ring, Mat &frame) {
+
+	Mat dropped;
+	while (quitFlag == 0 && pushFrame(ring, frame) != 0) {
+		if (dropOldestFlag == 1) {
+			if (popFrame(ring, dropped) == 0) {
+				ring.nDropped++;
+			}
+		} else {
+			std::this_thread::sleep_for(std::chrono::microseconds(200));
+		}
+	}
+	if (frame.empty()) { // got back the empty header swapped in by the drop
+		cv::swap(frame, dropped);
+	}
+}
+
+
+/// @brief Parse the command line options
+///
+/// -threads N  run the 3 per-channel stage chains on N threads
+/// -pipeline   capture, process and display on separate threads
+/// -dropoldest drop the oldest queued frame when a stage falls behind
+/// -headless   no windows or drawing, print the detections
+/// -in SPEC    camera, video file, image directory, raw BGR file, V4L2
+///             camera, raw YUYV, NV12 or I420 file, MJPEG file or
+///             generated markers, more than once for several inputs
+/// -realtime   pace recorded input to its frame rate
+/// -fps F      frame rate to pace recorded input to
+/// -truth PATH ground truth of generated frames as JSON lines
+/// -multi      report every instance of each color code
+/// -pyramid N  full frame searches look at 1/N scale first
+/// -reload     reload the thresholds when the config file changes
+/// -calibpct P calibrate to percentiles P and 100-P of the box
+/// -jpegscale N decode MJPEG frames at 1/N scale
+/// -jpegroi    ROI tracking, decoding only the search windows
+/// -greedy     claim channel rects code by code in code order
+/// -bench      time the processing functions and exit
+/// -out SINK   per-frame results to jsonl, bin:PATH or shm:NAME
+///
+/// @param argc argument count from main
+/// @param argv arguments from main
+///
+/// @return 0 if successful, 1 if an option is not recognized
+///
+int parseArgs(int argc, char* argv[]) {
+
+	int i;
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc) {
+			nChannelThreads = atoi(argv[++i]);
+			if (nChannelThreads < 1) {
+				nChannelThreads = 1;
+			}
+		} else if (strcmp(argv[i], "-pipeline") == 0) {
+			pipelineFlag = 1;
+		} else if (strcmp(argv[i], "-dropoldest") == 0) {
+			dropOldestFlag = 1;
+		} else if (strcmp(argv[i], "-headless") == 0) {
+			headlessFlag = 1;
+			trackModeFlag = 1; // calibration needs the window
+		} else if (strcmp(argv[i], "-in") == 0 && i + 1 < argc) {
+			if (nInputs == MAXCAMERAS) {
+				fprintf(stderr, "at most %d inputs\n", MAXCAMERAS);
+				return 1;
+			}
+			inputSpecs[nInputs++] = argv[++i];
+		} else if (strcmp(argv[i], "-realtime") == 0) {
+			realtimeFlag = 1;
+		} else if (strcmp(argv[i], "-fps") == 0 && i + 1 < argc) {
+			inputFps = atof(argv[++i]);
+		} else if (strcmp(argv[i], "-truth") == 0 && i + 1 < argc) {
+			truthFile = fopen(argv[++i], "w");
+			if (truthFile == NULL) {
+				fprintf(stderr, "ground truth file open error!\n");
+				return 1;
+			}
+		} else if (strcmp(argv[i], "-pyramid") == 0 && i + 1 < argc) {
+			pyramidScale = atoi(argv[++i]);
+			if (pyramidScale != 2 && pyramidScale != 4) {
+				fprintf(stderr, "-pyramid takes 2 or 4\n");
+				return 1;
+			}
+		} else if (strcmp(argv[i], "-jpegscale") == 0 && i + 1 < argc) {
+			jpegScale = atoi(argv[++i]);
+			if (jpegScale != 1 && jpegScale != 2 && jpegScale != 4 && jpegScale != 8) {
+				fprintf(stderr, "-jpegscale takes 1, 2, 4 or 8\n");
+				return 1;
+			}
+		} else if (strcmp(argv[i], "-jpegroi") == 0) {
+			jpegRoiFlag = 1;
+			roiModeFlag = 1;
+		} else if (strcmp(argv[i], "-reload") == 0) {
+			reloadFlag = 1;
+		} else if (strcmp(argv[i], "-calibpct") == 0 && i + 1 < argc) {
+			calibPercentile = atof(argv[++i]);
+			if (calibPercentile < 0 || calibPercentile >= 50) {
+				fprintf(stderr, "-calibpct takes 0 to under 50\n");
+				return 1;
+			}
+		} else if (strcmp(argv[i], "-greedy") == 0) {
+			globalAssignFlag = 0;
+		} else if (strcmp(argv[i], "-multi") == 0) {
+			multiCCFlag = 1;
+		} else if (strcmp(argv[i], "-bench") == 0) {
+			benchFlag = 1;
+			headlessFlag = 1; // time the processing only
+		} else if (strcmp(argv[i], "-out") == 0 && i + 1 < argc) {
+			i++;
+			if (strcmp(argv[i], "jsonl") == 0) {
+				resultSinkFlag = SINK_JSONL;
+			} else if (strncmp(argv[i], "bin:", 4) == 0) {
+				resultSinkFlag = SINK_BINARY;
+				resultSinkPath = argv[i] + 4;
+			} else if (strncmp(argv[i], "shm:", 4) == 0) {
+				resultSinkFlag = SINK_SHM;
+				resultSinkPath = argv[i] + 4;
+			} else {
+				fprintf(stderr, "unknown result sink %s\n", argv[i]);
+				return 1;
+			}
+		} else {
+			fprintf(stderr, "usage: %s [-threads N] [-pipeline] [-dropoldest] [-headless] [-in cam:N|VIDEO|DIR|raw:WxH:PATH|v4l2:[WxH:][nv12:|mjpeg:]DEVICE|yuyv:WxH:PATH|nv12:WxH:PATH|i420:WxH:PATH|mjpeg:PATH|synth:N,... ...] [-realtime] [-fps F] [-truth PATH] [-multi] [-pyramid 2|4] [-jpegscale 1|2|4|8] [-jpegroi] [-reload] [-calibpct P] [-greedy] [-bench] [-out jsonl|bin:PATH|shm:NAME]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (nInputs > 1) { // -threads sizes the shared pool of runMultiCamera instead
+		if (truthFile != NULL) {
+			fprintf(stderr, "-truth takes one input\n");
+			return 1;
+		}
+		headlessFlag = 1;
+		trackModeFlag = 1;
+		pipelineFlag = 0;
+		return 0;
+	}
+	return 0;
+}
+
+
+StageTimer::~StageTimer() {
+	recordStageTime(stage, getTickCount() - startTicks);
+}
+
+
+/// @brief Add one measured duration to a stage's latency histogram
+///
+/// Only relaxed atomic increments, so any thread can record without
+/// locking.
+///
+/// @param stage stage index (STAGE_*)
+/// @param ticks duration in getTickCount ticks
+///
+/// @return Void
+///
+void recordStageTime(int stage, int64 ticks) {
+
+	static const double nsPerTick = 1e9/getTickFrequency();
+	uint64_t ns = ticks > 0 ? (uint64_t)(ticks*nsPerTick) : 0;
+	int bucket, shift = 0;
+	if (ns >= 2*HISTSUB) {
+		int msb = 63 - __builtin_clzll(ns);
+		shift = msb - HISTSUBBITS;
+	}
+	bucket = shift*HISTSUB + (int)(ns >> shift);
+	if (bucket >= HISTBUCKETS) {
+		bucket = HISTBUCKETS - 1;
+	}
+	StageHistogram &hist = stageHistograms[stage];
+	hist.counts[bucket].fetch_add(1, std::memory_order_relaxed);
+	hist.nSamples.fetch_add(1, std::memory_order_relaxed);
+	hist.sumNs.fetch_add(ns, std::memory_order_relaxed);
+	uint64_t prevMax = hist.maxNs.load(std::memory_order_relaxed);
+	while (ns > prevMax && !hist.maxNs.compare_exchange_weak(prevMax, ns, std::memory_order_relaxed)) {
+	}
+}
+
+
+/// @brief Value at a percentile of a stage's latency histogram
+///
+/// @param hist stage histogram
+/// @param nSamples number of samples in it
+/// @param percentile 0..100
+///
+/// @return upper edge of the bucket holding that percentile [ns]
+///
+uint64_t getHistogramPercentile(StageHistogram &hist, uint64_t nSamples, double percentile) {
+
+	int bucket, shift;
+	uint64_t seen = 0;
+	uint64_t target = (uint64_t)(nSamples*percentile/100.0 + 0.5);
+	if (target < 1) {
+		target = 1;
+	}
+	for (bucket = 0; bucket < HISTBUCKETS; bucket++) {
+		seen += hist.counts[bucket].load(std::memory_order_relaxed);
+		if (seen >= target) {
+			break;
+		}
+	}
+	shift = bucket < 2*HISTSUB ? 0 : bucket/HISTSUB - 1;
+	return ((uint64_t)(bucket - shift*HISTSUB + 1) << shift) - 1;
+}
+
+
+/// @brief Print count, mean, p50, p99 and max of every stage that has
+/// been timed, to stderr so result streams on stdout stay clean
+///
+/// Stages inside the per-channel chain are timed once per channel and
+/// search window.
+///
+/// @return Void
+///
+void dumpStageHistograms() {
+
+	int stage;
+	fprintf(stderr, "%-18s %10s %10s %10s %10s %10s\n", "stage [us]", "count", "mean", "p50", "p99", "max");
+	for (stage = 0; stage < NSTAGES; stage++) {
+		StageHistogram &hist = stageHistograms[stage];
+		uint64_t n = hist.nSamples.load(std::memory_order_relaxed);
+		if (n == 0) {
+			continue;
+		}
+		uint64_t maxNs = hist.maxNs.load(std::memory_order_relaxed);
+		// bucket edges can overshoot the largest sample
+		uint64_t p50Ns = std::min(getHistogramPercentile(hist, n, 50), maxNs);
+		uint64_t p99Ns = std::min(getHistogramPercentile(hist, n, 99), maxNs);
+		fprintf(stderr, "%-18s %10llu %10.1f %10.1f %10.1f %10.1f\n", stageNames[stage], (unsigned long long)n,
+				hist.sumNs.load(std::memory_order_relaxed)/1000.0/n, p50Ns/1000.0, p99Ns/1000.0, maxNs/1000.0);
+	}
+	if (trackAllocFrames > 0) {
+		fprintf(stderr, "tracking allocations per frame over %d frames: operator new %.2f, Mat %.2f\n", (int)trackAllocFrames,
+				(double)trackHeapAllocs/trackAllocFrames, (double)trackMatAllocs/trackAllocFrames);
+	}
+	if (cameraInputs != NULL) {
+		dumpInputRates();
+	}
+}
+
+
+/// @brief Count every operator new call, for the allocations per frame
+/// reported by -bench and at the end of tracking
+void *operator new(size_t size) {
+	nHeapAllocs.fetch_add(1, std::memory_order_relaxed);
+	void *ptr = malloc(size ? size : 1);
+	if (ptr == NULL) {
+		throw std::bad_alloc();
+	}
+	return ptr;
+}
+
+
+void operator delete(void *ptr) noexcept {
+	free(ptr);
+}
+
+
+UMatData* CountingMatAllocator::allocate(int dims, const int* sizes, int type, void* data, size_t* step, int flags, UMatUsageFlags usageFlags) const {
+	nMatAllocs.fetch_add(1, std::memory_order_relaxed);
+	return Mat::getStdAllocator()->allocate(dims, sizes, type, data, step, flags, usageFlags);
+}
+
+
+bool CountingMatAllocator::allocate(UMatData* data, int accessFlags, UMatUsageFlags usageFlags) const {
+	return Mat::getStdAllocator()->allocate(data, accessFlags, usageFlags);
+}
+
+
+void CountingMatAllocator::deallocate(UMatData* data) const {
+	Mat::getStdAllocator()->deallocate(data);
+}
+
+
+/// @brief Time the processing functions over a sweep of synthetic
+/// frames and, with -in, on the first frame of the recording
+///
+/// Synthetic frames go from 320x240 to 3840x2160 with 1 to 64 color
+/// codes. Prints ns/frame, Mpixels/s and heap and Mat allocations per
+/// frame for every function, after one untimed warm-up call.
+///
+/// @return Void
+///
+void runBenchmarks() {
+
+	// channel 1 red, 2 green, 3 blue
+	int benchMIN[3][3] = {{0, 100, 100}, {50, 100, 100}, {110, 100, 100}};
+	int benchMAX[3][3] = {{10, 255, 255}, {70, 255, 255}, {130, 255, 255}};
+	Size frameSizes[5] = {Size(320, 240), Size(640, 480), Size(1280, 720), Size(1920, 1080), Size(3840, 2160)};
+	int codeCounts[4] = {1, 4, 16, 64};
+	int i, j;
+	char label[64], spec[64];
+	Mat frame;
+	SyntheticScene scene;
+	resultSinkFlag = SINK_NONE;
+	Mat::setDefaultAllocator(&countingMatAllocator);
+	printf("%-18s %-16s %6s %12s %9s %11s %10s\n", "function", "frame", "codes", "ns/frame", "Mpx/s", "new/frame", "Mat/frame");
+	for (i = 0; i < 5; i++) {
+		for (j = 0; j < 4; j++) {
+			sprintf(spec, "%d,size=%dx%d", codeCounts[j], frameSizes[i].width, frameSizes[i].height);
+			initSyntheticScene(scene, spec, benchMIN, benchMAX);
+			drawSyntheticFrame(scene, frame);
+			sprintf(label, "%dx%d", frameSizes[i].width, frameSizes[i].height);
+			benchmarkFrame(label, frame, benchMIN, benchMAX, codeCounts[j]);
+		}
+	}
+	if (inputSpecs[0] != NULL) { // recorded frame with the configured thresholds
+		FrameSource source;
+		int MINHSV[3][3] = {{255, 255, 255}, {255, 255, 255}, {255, 255, 255}};
+		int MAXHSV[3][3] = {{0, 0, 0}, {0, 0, 0}, {0, 0, 0}};
+		loadConfigFile(MINHSV, MAXHSV, 3);
+		if (openFrameSource(source, inputSpecs[0]) == 0 && readFrame(source, frame) == 0) {
+			if (frame.type() != CV_8UC3) { // the functions take BGR
+				Mat yuv = frame.clone();
+				cvtColor(yuv, frame, frame.type() == CV_8UC2 ? CV_YUV2BGR_YUYV : CV_YUV2BGR_NV12);
+			}
+			sprintf(label, "rec %dx%d", frame.cols, frame.rows);
+			benchmarkFrame(label, frame, MINHSV, MAXHSV, 0);
+		}
+		closeFrameSource(source);
+	}
+	Mat::setDefaultAllocator(NULL);
+	benchmarkPairing();
+}
+
+
+/// @brief Time every benchmarked function on one frame
+///
+/// @param label frame description for the report
+/// @param frame BGR frame
+/// @param MINHSV minimum HSV thresholds for 3 channels [H S V]
+/// @param MAXHSV maximum HSV thresholds for 3 channels [H S V]
+/// @param nCodes color codes drawn in the frame, 0 if unknown
+///
+/// @return Void
+///
+void benchmarkFrame(const char *label, Mat &frame, int MINHSV[][3], int MAXHSV[][3], int nCodes) {
+
+	int func, iter, ch;
+	int nIterations = std::max(3, (int)(BENCHPIXELS/frame.total()));
+	vector<Rect> rects[3]; // dilated rects of each channel
+	vector<Rect> workRects;
+	Mat workThresh;
+	// inputs of the later stages
+	imgOriginal = frame.clone(); // detectBlobs draws on it
+	runBenchFunction(BENCH_CVTINRANGE, frame, MINHSV, MAXHSV, rects, workRects, workThresh);
+	Mat *masks[3] = {&imgThreshCh1, &imgThreshCh2, &imgThreshCh3};
+	for (ch = 0; ch < 3; ch++) {
+		erodeMask(*masks[ch], workThresh, trackerScratch.channels[0].erodeRows);
+		getThresholdRects(workThresh, rects[ch], Point(0, 0), 1, trackerScratch.channels[0]);
+		dilateRects(35, rects[ch]);
+	}
+	for (func = 0; func < NBENCH; func++) {
+		runBenchFunction(func, frame, MINHSV, MAXHSV, rects, workRects, workThresh); // warm up
+		uint64_t heapStart = nHeapAllocs.load(std::memory_order_relaxed);
+		uint64_t matStart = nMatAllocs.load(std::memory_order_relaxed);
+		int64 benchTicks = getTickCount();
+		for (iter = 0; iter < nIterations; iter++) {
+			runBenchFunction(func, frame, MINHSV, MAXHSV, rects, workRects, workThresh);
+		}
+		double seconds = (getTickCount() - benchTicks)/getTickFrequency();
+		printf("%-18s %-16s %6d %12.0f %9.1f %11.1f %10.1f\n", benchNames[func], label, nCodes,
+				seconds*1e9/nIterations, frame.total()*(double)nIterations/seconds/1e6,
+				(double)(nHeapAllocs.load(std::memory_order_relaxed) - heapStart)/nIterations,
+				(double)(nMatAllocs.load(std::memory_order_relaxed) - matStart)/nIterations);
+	}
+}
+
+
+/// @brief Time getCCRectBinary against getCCRectBinaryAllPairs for 16
+/// to 4096 random rects per channel in a 1920x1080 frame and check that
+/// both pick the same pair
+///
+/// @return Void
+///
+void benchmarkPairing() {
+
+	int rectCounts[5] = {16, 64, 256, 1024, 4096};
+	int i, n, iter, way;
+	RNG rng(12345);
+	printf("\n%-18s %8s %14s %14s %6s\n", "pairing", "rects", "all pairs ns", "sweep ns", "same");
+	for (i = 0; i < 5; i++) {
+		vector<Rect> rectsA, rectsB;
+		for (n = 0; n < rectCounts[i]; n++) {
+			rectsA.push_back(Rect(rng.uniform(0, 1900), rng.uniform(0, 1060), rng.uniform(8, 60), rng.uniform(8, 60)));
+			rectsB.push_back(Rect(rng.uniform(0, 1900), rng.uniform(0, 1060), rng.uniform(8, 60), rng.uniform(8, 60)));
+		}
+		vector<int> usedA(rectsA.size()), usedB(rectsB.size());
+		Rect ccRects[2][3];
+		int ccParts[2][3][2] = {{{-1, -1}}, {{-1, -1}}};
+		double nsPerCall[2];
+		int nIterations = std::max(3, 20000000/(rectCounts[i]*rectCounts[i]));
+		for (way = 0; way < 2; way++) {
+			int64 benchTicks = getTickCount();
+			for (iter = 0; iter < nIterations; iter++) {
+				std::fill(usedA.begin(), usedA.end(), 0);
+				std::fill(usedB.begin(), usedB.end(), 0);
+				if (way == 0) {
+					getCCRectBinaryAllPairs(rectsA, rectsB, usedA, usedB, ccRects[way], ccParts[way], 0);
+				} else {
+					getCCRectBinary(rectsA, rectsB, usedA, usedB, ccRects[way], ccParts[way], 0);
+				}
+			}
+			nsPerCall[way] = (getTickCount() - benchTicks)/getTickFrequency()*1e9/nIterations;
+		}
+		int sameFlag = ccParts[0][0][0] == ccParts[1][0][0] && ccParts[0][0][1] == ccParts[1][0][1] && ccRects[0][0] == ccRects[1][0];
+		printf("%-18s %8d %14.0f %14.0f %6s\n", "getCCRectBinary", rectCounts[i], nsPerCall[0], nsPerCall[1], sameFlag ? "yes" : "NO");
+	}
+}
+
+
+/// @brief Run one benchmarked function once
+///
+/// @param func BENCH_*
+/// @param frame BGR frame
+/// @param MINHSV minimum HSV thresholds for 3 channels [H S V]
+/// @param MAXHSV maximum HSV thresholds for 3 channels [H S V]
+/// @param rects dilated rects of the 3 channels
+/// @param workRects scratch rect list
+/// @param workThresh scratch mask
+///
+/// @return Void
+///
+void runBenchFunction(int func, Mat &frame, int MINHSV[][3], int MAXHSV[][3], vector<Rect> rects[], vector<Rect> &workRects, Mat &workThresh) {
+
+	Rect ccRects[3];
+	int ccParts[3][2];
+	int box[4] = {frame.cols/4, frame.rows/4, frame.cols*3/4, frame.rows*3/4};
+	int boxMIN[3], boxMAX[3];
+	if (func == BENCH_CVTINRANGE) {
+		cvtColor(frame, imgHSV, CV_BGR2HSV);
+		inRange(imgHSV, Scalar(MINHSV[0][0], MINHSV[0][1], MINHSV[0][2]), Scalar(MAXHSV[0][0], MAXHSV[0][1], MAXHSV[0][2]), imgThreshCh1);
+		inRange(imgHSV, Scalar(MINHSV[1][0], MINHSV[1][1], MINHSV[1][2]), Scalar(MAXHSV[1][0], MAXHSV[1][1], MAXHSV[1][2]), imgThreshCh2);
+		inRange(imgHSV, Scalar(MINHSV[2][0], MINHSV[2][1], MINHSV[2][2]), Scalar(MAXHSV[2][0], MAXHSV[2][1], MAXHSV[2][2]), imgThreshCh3);
+	} else if (func == BENCH_ERODE) {
+		erodeMask(imgThreshCh1, workThresh, trackerScratch.channels[0].erodeRows);
+	} else if (func == BENCH_RECTS) {
+		workRects.clear();
+		getThresholdRects(workThresh, workRects, Point(0, 0), 1, trackerScratch.channels[0]);
+	} else if (func == BENCH_DILATE) {
+		workRects = rects[0];
+		dilateRects(35, workRects);
+	} else if (func == BENCH_PAIRING) {
+		vector<Rect> *codeRects[3][2] = {{&rects[0], &rects[1]}, {&rects[0], &rects[2]}, {&rects[1], &rects[2]}};
+		vector<CCMatch> matches;
+		int foundFlags[3];
+		pairColorCodes(codeRects, ccRects, ccParts, foundFlags, matches);
+	} else if (func == BENCH_BBOXHSV) {
+		calibHistogram.validFlag = 0; // time a box counted from scratch
+		getBoundingBoxHSV(imgHSV, box, 0, boxMIN, boxMAX);
+	} else if (func == BENCH_DETECTBLOBS) {
+		detectBlobs(MINHSV[0], MAXHSV[0]);
+	} else if (func == BENCH_DETECTCC) {
+		imgOriginal = frame;
+		detectCCBlobs(MINHSV, MAXHSV);
+	}
+}
+
+
+/// @brief Set up the synthetic frame generator
+///
+/// SPEC is N[,key=value...] for N color codes (up to MAXSYNTHCODES),
+/// each made of two touching squares in the colors of 2 channels,
+/// cycling through the channel pairs of codes 1, 2 and 3. Keys:
+///   size=WxH      frame size (default 640x480)
+///   marker=PX     side of each square (default from the grid cell)
+///   rot=DEG       markers swing up to DEG degrees (default 0)
+///   noise=AMP     uniform pixel noise amplitude (default 16)
+///   blur=K        Gaussian blur kernel size (default 0, none)
+///   drift=PCT     illumination swings by PCT percent (default 0)
+///   distract=N    single color blobs that are not codes (default 0)
+/// Markers start on a grid and then move and bounce off the borders.
+///
+/// @param scene generator state
+/// @param spec generator description
+/// @param MINHSV minimum HSV thresholds for 3 channels [H S V]
+/// @param MAXHSV maximum HSV thresholds for 3 channels [H S V]
+///
+/// @return 0 if successful, 1 if the description is not valid
+///
+int initSyntheticScene(SyntheticScene &scene, const char *spec, int MINHSV[][3], int MAXHSV[][3]) {
+
+	int i, value, width, height, nChars;
+	RNG rng(12345); // same scene on every run
+	scene.frameSize = Size(640, 480);
+	scene.markerSize = 0;
+	scene.maxRotation = 0;
+	scene.noise = 16;
+	scene.blurSize = 0;
+	scene.drift = 0;
+	scene.nDistractors = 0;
+	scene.frameIndex = 0;
+	scene.nTruthRects = 0;
+	if (sscanf(spec, "%d%n", &scene.nCodes, &nChars) != 1 || scene.nCodes < 0 || scene.nCodes > MAXSYNTHCODES) {
+		return 1;
+	}
+	for (spec += nChars; *spec == ','; spec += nChars) {
+		if (sscanf(spec, ",size=%dx%d%n", &width, &height, &nChars) == 2) {
+			scene.frameSize = Size(width, height);
+		} else if (sscanf(spec, ",marker=%d%n", &value, &nChars) == 1) {
+			scene.markerSize = value;
+		} else if (sscanf(spec, ",rot=%d%n", &value, &nChars) == 1) {
+			scene.maxRotation = value;
+		} else if (sscanf(spec, ",noise=%d%n", &value, &nChars) == 1) {
+			scene.noise = value;
+		} else if (sscanf(spec, ",blur=%d%n", &value, &nChars) == 1) {
+			scene.blurSize = value | 1; // odd kernel
+		} else if (sscanf(spec, ",drift=%d%n", &value, &nChars) == 1) {
+			scene.drift = value;
+		} else if (sscanf(spec, ",distract=%d%n", &value, &nChars) == 1) {
+			scene.nDistractors = value;
+		} else {
+			return 1;
+		}
+	}
+	if (*spec != '\0' || scene.frameSize.width < 16 || scene.frameSize.height < 16) {
+		return 1;
+	}
+	// middle of each channel's HSV range in BGR
+	Mat colorHSV(1, 3, CV_8UC3), colorBGR;
+	for (i = 0; i < 3; i++) {
+		colorHSV.at<Vec3b>(0, i) = Vec3b((MINHSV[i][0] + MAXHSV[i][0])/2, (MINHSV[i][1] + MAXHSV[i][1])/2, (MINHSV[i][2] + MAXHSV[i][2])/2);
+	}
+	cvtColor(colorHSV, colorBGR, CV_HSV2BGR);
+	for (i = 0; i < 3; i++) {
+		Vec3b color = colorBGR.at<Vec3b>(0, i);
+		scene.channelColors[i] = Scalar(color[0], color[1], color[2]);
+	}
+	// markers on a grid, distractors anywhere, all moving up to 2 px per frame
+	int nObjects = scene.nCodes + scene.nDistractors;
+	int gridSize = (int)ceil(sqrt((double)std::max(nObjects, 1)));
+	int cellW = scene.frameSize.width/gridSize, cellH = scene.frameSize.height/gridSize;
+	if (scene.markerSize <= 0) {
+		scene.markerSize = std::max(12, std::min(cellW/2, cellH)*6/10);
+	}
+	scene.positions.resize(nObjects);
+	scene.velocities.resize(nObjects);
+	scene.phases.resize(nObjects);
+	for (i = 0; i < nObjects; i++) {
+		scene.positions[i] = Point2f((float)((i % gridSize)*cellW + cellW/2), (float)((i / gridSize)*cellH + cellH/2));
+		scene.velocities[i] = Point2f((float)rng.uniform(-2.0, 2.0), (float)rng.uniform(-2.0, 2.0));
+		scene.phases[i] = (float)rng.uniform(0.0, 2*CV_PI);
+	}
+	for (i = 0; i < NSYNTHNOISE; i++) {
+		scene.noiseFrames[i].create(scene.frameSize, CV_8UC3);
+		randu(scene.noiseFrames[i], Scalar(0, 0, 0), Scalar(scene.noise, scene.noise, scene.noise));
+	}
+	return 0;
+}
+
+
+/// @brief Render the next frame of the synthetic scene and advance it
+///
+/// Fills scene.truthRects with the bounding rect of every marker. The
+/// noise comes from a few precomputed frames so a 1080p frame renders
+/// in a few ms, fast enough to stand in for a camera.
+///
+/// @param scene generator state
+/// @param frame BGR frame drawn, reuses its buffer
+///
+/// @return Void
+///
+void drawSyntheticFrame(SyntheticScene &scene, Mat &frame) {
+
+	int codeChannels[3][2] = {{0, 1}, {0, 2}, {1, 2}}; // channels of codes 1, 2 and 3
+	int i, k;
+	int side = scene.markerSize;
+	double t = scene.frameIndex;
+	double gain = 1 + scene.drift/100.0*sin(t*2*CV_PI/300); // one swing every 300 frames
+	Rect frameRect(Point(0, 0), scene.frameSize);
+	frame.create(scene.frameSize, CV_8UC3);
+	frame.setTo(Scalar(100*gain, 100*gain, 100*gain));
+	scene.nTruthRects = 0;
+	for (k = 0; k < (int)scene.positions.size(); k++) {
+		Point2f &center = scene.positions[k];
+		float angle = (float)(scene.maxRotation*CV_PI/180*sin(scene.phases[k] + t*0.05));
+		Point2f u(cos(angle), sin(angle)), v(-sin(angle), cos(angle));
+		if (k < scene.nCodes) {
+			// two squares side by side along u
+			Point corners[6];
+			float alongU[3] = {-(float)side, 0, (float)side};
+			for (i = 0; i < 3; i++) {
+				corners[i] = center + u*alongU[i] - v*(side/2.0f);
+				corners[5 - i] = center + u*alongU[i] + v*(side/2.0f);
+			}
+			Point squareA[4] = {corners[0], corners[1], corners[4], corners[5]};
+			Point squareB[4] = {corners[1], corners[2], corners[3], corners[4]};
+			fillConvexPoly(frame, squareA, 4, scene.channelColors[codeChannels[k % 3][0]]*gain);
+			fillConvexPoly(frame, squareB, 4, scene.channelColors[codeChannels[k % 3][1]]*gain);
+			int x1 = corners[0].x, y1 = corners[0].y, x2 = corners[0].x, y2 = corners[0].y;
+			for (i = 1; i < 6; i++) {
+				x1 = std::min(x1, corners[i].x); x2 = std::max(x2, corners[i].x);
+				y1 = std::min(y1, corners[i].y); y2 = std::max(y2, corners[i].y);
+			}
+			scene.truthRects[scene.nTruthRects++] = Rect(x1, y1, x2 - x1 + 1, y2 - y1 + 1) & frameRect;
+		} else { // distractor, one channel color
+			Point square[4] = {center + (-u - v)*(side/2.0f), center + (u - v)*(side/2.0f), center + (u + v)*(side/2.0f), center + (v - u)*(side/2.0f)};
+			fillConvexPoly(frame, square, 4, scene.channelColors[k % 3]*gain);
+		}
+		// move, bouncing off the borders
+		center += scene.velocities[k];
+		if (center.x < side || center.x > scene.frameSize.width - side) {
+			scene.velocities[k].x = -scene.velocities[k].x;
+		}
+		if (center.y < side || center.y > scene.frameSize.height - side) {
+			scene.velocities[k].y = -scene.velocities[k].y;
+		}
+	}
+	if (scene.noise > 0) {
+		add(frame, scene.noiseFrames[scene.frameIndex % NSYNTHNOISE], frame);
+	}
+	if (scene.blurSize > 1) {
+		GaussianBlur(frame, frame, Size(scene.blurSize, scene.blurSize), 0);
+	}
+	scene.frameIndex++;
+}
+
+
+/// @brief Write the ground truth of the last generated frame to the
+/// -truth file as a JSON line
+///
+/// Codes are numbered as in the result records: 0 is channels 1-2, 1 is
+/// 1-3 and 2 is 2-3. Frames are numbered as generated, which matches
+/// the result frame index unless frames were skipped or dropped.
+///
+/// @param scene generator state
+///
+/// @return Void
+///
+void writeGroundTruth(SyntheticScene &scene) {
+
+	int i;
+	if (truthFile == NULL) {
+		return;
+	}
+	fprintf(truthFile, "{\"frame\":%d,\"codes\":[", scene.frameIndex - 1);
+	for (i = 0; i < scene.nTruthRects; i++) {
+		Rect &r = scene.truthRects[i];
+		fprintf(truthFile, "%s{\"code\":%d,\"rect\":[%d,%d,%d,%d]}", i ? "," : "", i % 3, r.x, r.y, r.width, r.height);
+	}
+	fprintf(truthFile, "]}\n");
+}
+
+
+/// @brief Close the -truth file, if any
+///
+/// @return Void
+///
+void closeGroundTruth() {
+
+	if (truthFile != NULL) {
+		fclose(truthFile);
+		truthFile = NULL;
+	}
+}
+
+
+/// @brief Start the worker threads of a thread pool
+///
+/// The threads live until stopThreadPool and sleep between batches, so
+/// nothing is spawned per frame.
+///
+/// @param pool thread pool
+/// @param nThreads number of worker threads, not counting the caller
+///
+/// @return Void
+///
+void startThreadPool(ThreadPool &pool, int nThreads) {
+
+	int i;
+	pool.taskFunc = NULL;
+	pool.taskArg = NULL;
+	pool.nTasks = 0;
+	pool.nextTask = 0;
+	pool.nPending = 0;
+	pool.nActive = 0;
+	pool.generation = 0;
+	pool.quitFlag = 0;
+	for (i = 0; i < nThreads; i++) {
+		pool.workers.push_back(std::thread(threadPoolWorker, &pool));
+	}
+}
+
+
+/// @brief Stop and join the worker threads of a thread pool
+///
+/// @param pool thread pool
+///
+/// @return Void
+///
+void stopThreadPool(ThreadPool &pool) {
+
+	int i;
+	{
+		std::lock_guard<std::mutex> guard(pool.lock);
+		pool.quitFlag = 1;
+	}
+	pool.wake.notify_all();
+	for (i = 0; i < pool.workers.size(); i++) {
+		pool.workers[i].join();
+	}
+	pool.workers.clear();
+}
+
+
+/// @brief Run func(arg, 0) .. func(arg, nTasks-1) on the pool and the
+/// calling thread, and return when all have finished
+///
+/// Without worker threads the tasks run in order on the caller.
+///
+/// @param pool thread pool
+/// @param nTasks number of tasks
+/// @param func task function, gets arg and the task index
+/// @param arg passed to every task
+///
+/// @return Void
+///
+void runParallel(ThreadPool &pool, int nTasks, void (*func)(void *arg, int task), void *arg) {
+
+	int task;
+	if (pool.workers.size() == 0) {
+		for (task = 0; task < nTasks; task++) {
+			func(arg, task);
+		}
+		return;
+	}
+	std::unique_lock<std::mutex> guard(pool.lock);
+	pool.taskFunc = func;
+	pool.taskArg = arg;
+	pool.nTasks = nTasks;
+	pool.nextTask = 0;
+	pool.nPending = nTasks;
+	pool.generation++;
+	pool.wake.notify_all();
+	while (pool.nextTask < pool.nTasks) {
+		task = pool.nextTask++;
+		guard.unlock();
+		func(arg, task);
+		guard.lock();
+		pool.nPending--;
+	}
+	// workers still holding this batch must let go before the next one
+	while (pool.nPending > 0 || pool.nActive > 0) {
+		pool.done.wait(guard);
+	}
+}
+
+
+/// @brief Worker thread loop of a thread pool
+///
+/// @param pool thread pool
+///
+/// @return Void
+///
+void threadPoolWorker(ThreadPool *pool) {
+
+	int task;
+	unsigned seenGeneration = 0;
+	std::unique_lock<std::mutex> guard(pool->lock);
+	while (1) {
+		while (pool->quitFlag == 0 && pool->generation == seenGeneration) {
+			pool->wake.wait(guard);
+		}
+		if (pool->quitFlag == 1) {
+			return;
+		}
+		seenGeneration = pool->generation;
+		pool->nActive++;
+		while (pool->nextTask < pool->nTasks) {
+			task = pool->nextTask++;
+			guard.unlock();
+			pool->taskFunc(pool->taskArg, task);
+			guard.lock();
+			pool->nPending--;
+		}
+		pool->nActive--;
+		if (pool->nPending == 0 && pool->nActive == 0) {
+			pool->done.notify_all();
+		}
+	}
+}
+
+
+/// @brief Detect 2-channel color codes blobs over 3 channels
+///
+/// In ROI mode only expanded windows around the color codes found in
+/// the previous frame are converted, thresholded and searched. The
+/// whole frame is searched every ROIREFRESHPERIOD frames, when nothing
+/// is being tracked, or after a tracked color code was lost.
+///
+/// @param MINHSV
+/// @param MAXHSV
+///
+/// @return Void
+///
+void detectCCBlobs(int MINHSV[][3], int MAXHSV[][3]) {
+
+	int i;
+	int dilateFactor = 35; // Amount to increase rect size by [%]
+	vector<Rect> &myFilteredRects1 = trackerScratch.filteredRects[0];
+	vector<Rect> &myFilteredRects2 = trackerScratch.filteredRects[1];
+	vector<Rect> &myFilteredRects3 = trackerScratch.filteredRects[2];
+	vector<Rect> &mySearchRegions = trackerScratch.searchRegions;
+	vector<CCMatch> &myMatches = trackerScratch.matches; // every instance, with -multi
+	Rect myCCRects[21];
+	int myCCParts[21][2]; // indices of the channel rects making up each color code
+	int myCCFoundFlags[3];
+	vector<Rect> *myCodeRects[3][2] = {{&myFilteredRects1, &myFilteredRects2}, {&myFilteredRects1, &myFilteredRects3}, {&myFilteredRects2, &myFilteredRects3}};
+	Scalar tmpColor = Scalar(255);
+	Scalar ch1Color = Scalar(0, 213, 255);
+	Scalar ch2Color = Scalar(181, 113, 220);
+	Scalar ch3Color = Scalar(199, 220, 113);
+	Scalar roiColor = Scalar(128, 128, 128);
+	for(i=0;i<3;i++) {
+		trackerScratch.filteredRects[i].clear();
+	}
+	myMatches.clear();
+	if (trackerScratch.searchRegions.capacity() < PAIRRESERVE) {
+		reserveTrackerScratch(trackerScratch);
+	}
+	frameThreshMode = threshModeFlag; // keys may change them during the frame
+	frameRoiMode = roiModeFlag;
+
+	// pick the parts of the frame to search
+	predictCCTracks(getFrameSize(imgOriginal));
+	int fullSearchFlag = getSearchRegions(getFrameSize(imgOriginal), mySearchRegions);
+	if(fullSearchFlag == 1 && pyramidScale > 1) {
+		StageTimer timer(STAGE_COARSE);
+		getCoarseRegions(MINHSV, MAXHSV, dilateFactor, mySearchRegions);
+	}
+	// get bounding rectangles from thresholded binary images
+	// and expand them
+	for(i=0;i<mySearchRegions.size();i++) {
+		getRegionRects(mySearchRegions[i], MINHSV, MAXHSV, dilateFactor, myFilteredRects1, myFilteredRects2, myFilteredRects3);
+	}
+
+	// draw retangles for visualization
+	if(headlessFlag == 0) {
+		StageTimer timer(STAGE_RENDER);
+		if(fullSearchFlag == 0 || pyramidScale > 1) {
+			for(i=0;i<mySearchRegions.size();i++) {
+				rectangle(imgOriginal, mySearchRegions[i].tl(), mySearchRegions[i].br(), roiColor, 1, 8, 0); // search window
+			}
+		}
+		for(i=0;i<myFilteredRects1.size();i++) {
+			rectangle(imgOriginal, myFilteredRects1[i].tl(), myFilteredRects1[i].br(), ch1Color, 2, 8, 0); // bounding box
+		}
+		for(i=0;i<myFilteredRects2.size();i++) {
+			rectangle(imgOriginal, myFilteredRects2[i].tl(), myFilteredRects2[i].br(), ch2Color, 2, 8, 0); // bounding box
+		}
+		for(i=0;i<myFilteredRects3.size();i++) {
+			rectangle(imgOriginal, myFilteredRects3[i].tl(), myFilteredRects3[i].br(), ch3Color, 2, 8, 0); // bounding box
+		}
+	}
+
+	// find 2-color-code blobs
+	{
+		StageTimer timer(STAGE_PAIRING);
+		pairColorCodes(myCodeRects, myCCRects, myCCParts, myCCFoundFlags, myMatches);
+	}
+	if(headlessFlag == 0) {
+		StageTimer timer(STAGE_RENDER);
+		for(i=0;i<3;i++) {
+			if(myCCFoundFlags[i] == 1) {
+				rectangle(imgOriginal, myCCRects[i].tl(), myCCRects[i].br(), tmpColor, 2, 8, 0); // CC blob
+			}
+		}
+		for(i=0;i<myMatches.size();i++) {
+			rectangle(imgOriginal, myMatches[i].rect.tl(), myMatches[i].rect.br(), tmpColor, 1, 8, 0); // other instances
+		}
+	}
+	fillFrameResult(myCCRects, myCCFoundFlags, myCCParts, myCodeRects, myMatches);
+	emitFrameResult(frameResult);
+
+	updateCCTracks(myCCRects, myCCFoundFlags, fullSearchFlag);
+}
+
+
+/// @brief Pair up the channel rects into color codes
+///
+/// By default the channel rects are shared out between the 3 codes by
+/// assignCCGlobal. With -greedy, codes 0, 1 and 2 claim rects in that
+/// order, which lets a weak code 0 pair take a rect from a strong code
+/// 1 pair.
+///
+/// @param codeRects the two channel rect vectors of each color code
+/// @param ccRects gets the rect of each color code found
+/// @param ccParts gets the indices of the two channel rects of each color code
+/// @param foundFlags gets 1 for each color code found
+/// @param matches gets every instance with -multi
+///
+/// @return Void
+///
+void pairColorCodes(vector<Rect> *codeRects[][2], Rect ccRects[], int ccParts[][2], int foundFlags[], vector<CCMatch> &matches) {
+
+	int i;
+	vector<CCMatch> &chosen = trackerScratch.chosen;
+	vector<Rect> *channelRects[3] = {codeRects[0][0], codeRects[0][1], codeRects[1][1]};
+	vector<int> *usedRects = trackerScratch.usedRects;
+	chosen.clear();
+	for(i=0;i<3;i++) {
+		usedRects[i].assign(channelRects[i]->size(), 0); // keeping track of rectangles used already
+		foundFlags[i] = 0;
+	}
+	if (globalAssignFlag == 1) {
+		assignCCGlobal(codeRects, chosen);
+	} else if (multiCCFlag == 0) {
+		foundFlags[0] = (getCCRectBinary(*channelRects[0], *channelRects[1], usedRects[0], usedRects[1], ccRects, ccParts, 0) == 0);
+		foundFlags[1] = (getCCRectBinary(*channelRects[0], *channelRects[2], usedRects[0], usedRects[2], ccRects, ccParts, 1) == 0);
+		foundFlags[2] = (getCCRectBinary(*channelRects[1], *channelRects[2], usedRects[1], usedRects[2], ccRects, ccParts, 2) == 0);
+		return;
+	} else {
+		getCCRectsAll(*channelRects[0], *channelRects[1], usedRects[0], usedRects[1], chosen, 0);
+		getCCRectsAll(*channelRects[0], *channelRects[2], usedRects[0], usedRects[2], chosen, 1);
+		getCCRectsAll(*channelRects[1], *channelRects[2], usedRects[1], usedRects[2], chosen, 2);
+	}
+	// the largest instance of each code stands for it in the rest
+	for(i=0;i<chosen.size();i++) {
+		CCMatch &match = chosen[i];
+		if(foundFlags[match.code] == 0 || match.rect.area() > ccRects[match.code].area()) {
+			foundFlags[match.code] = 1;
+			ccRects[match.code] = match.rect;
+			ccParts[match.code][0] = match.partA;
+			ccParts[match.code][1] = match.partB;
+		}
+	}
+	if (multiCCFlag == 1) {
+		matches.assign(chosen.begin(), chosen.end());
+	}
+}
+
+
+/// @brief Fill frameResult with the color codes found in the current frame
+///
+/// @param ccRects color code rectangles found in this frame
+/// @param foundFlags 1 for each color code found in this frame
+/// @param ccParts indices of the two channel rects of each color code
+/// @param codeRects the two channel rect vectors of each color code
+/// @param matches every color code instance with -multi, else empty.
+/// Only the first MAXCCINSTANCES are reported.
+///
+/// @return Void
+///
+void fillFrameResult(Rect ccRects[], int foundFlags[], int ccParts[][2], vector<Rect> *codeRects[][2], vector<CCMatch> &matches) {
+
+	int i;
+	memset(&frameResult, 0, sizeof(frameResult));
+	frameResult.magic = RESULTMAGIC;
+	frameResult.frameIndex = tracker->frameCount;
+	frameResult.camera = tracker->camera;
+	frameResult.timestamp = ((double)getTickCount() - startTicks)/getTickFrequency();
+	for(i=0;i<3;i++) {
+		frameResult.cc[i].found = foundFlags[i];
+		if(foundFlags[i] == 1) {
+			fillCCResult(frameResult.cc[i], ccRects[i], (*codeRects[i][0])[ccParts[i][0]], (*codeRects[i][1])[ccParts[i][1]]);
+		}
+	}
+	for(i=0;i<matches.size() && i<MAXCCINSTANCES;i++) {
+		CCMatch &match = matches[i];
+		CCInstance &instance = frameResult.instances[frameResult.nInstances++];
+		instance.code = match.code;
+		instance.cc.found = 1;
+		fillCCResult(instance.cc, match.rect, (*codeRects[match.code][0])[match.partA], (*codeRects[match.code][1])[match.partB]);
+	}
+}
+
+
+/// @brief Fill the record of one detected color code
+///
+/// @param cc color code record
+/// @param ccRect color code rectangle
+/// @param a first channel rect of the color code
+/// @param b second channel rect of the color code
+///
+/// @return Void
+///
+void fillCCResult(CCResult &cc, Rect ccRect, Rect a, Rect b) {
+
+	int smallerArea = a.area() < b.area() ? a.area() : b.area();
+	cc.rect[0] = ccRect.x; cc.rect[1] = ccRect.y; cc.rect[2] = ccRect.width; cc.rect[3] = ccRect.height;
+	cc.partA[0] = a.x; cc.partA[1] = a.y; cc.partA[2] = a.width; cc.partA[3] = a.height;
+	cc.partB[0] = b.x; cc.partB[1] = b.y; cc.partB[2] = b.width; cc.partB[3] = b.height;
+	cc.confidence = smallerArea > 0 ? (float)(a & b).area() / smallerArea : 0.0f;
+}
+
+
+/// @brief Open the result sink picked on the command line
+///
+/// Headless runs without -out write JSON lines to stdout.
+///
+/// @return 0 if successful, 1 if the file or shared memory could not
+/// be opened
+///
+int openResultSink() {
+
+	if (resultSinkFlag == SINK_NONE && headlessFlag == 1) {
+		resultSinkFlag = SINK_JSONL;
+	}
+	if (resultSinkFlag == SINK_BINARY) {
+		resultFile = fopen(resultSinkPath, "wb");
+		if (resultFile == NULL) {
+			fprintf(stderr, "result file open error!\n");
+			return 1;
+		}
+	} else if (resultSinkFlag == SINK_SHM) {
+		int fd = shm_open(resultSinkPath, O_CREAT | O_RDWR, 0644);
+		if (fd < 0 || ftruncate(fd, sizeof(ShmResultRing)) != 0) {
+			fprintf(stderr, "result shared memory open error!\n");
+			return 1;
+		}
+		void *mem = mmap(NULL, sizeof(ShmResultRing), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (mem == MAP_FAILED) {
+			fprintf(stderr, "result shared memory map error!\n");
+			return 1;
+		}
+		resultShm = new (mem) ShmResultRing;
+		resultShm->writeCount.store(0);
+		resultShm->startCount.store(0);
+		resultShm->recordSize = sizeof(FrameResult);
+		resultShm->capacity = SHMRINGSIZE;
+		resultShm->reserved = 0;
+		resultShm->magic = RESULTMAGIC; // last, readers check it first
+	}
+	return 0;
+}
+
+
+/// @brief Flush and close the result sink
+///
+/// @return Void
+///
+void closeResultSink() {
+
+	if (resultFile != NULL) {
+		fclose(resultFile);
+		resultFile = NULL;
+	}
+	if (resultShm != NULL) {
+		munmap(resultShm, sizeof(ShmResultRing));
+		resultShm = NULL;
+	}
+}
+
+
+/// @brief Write one frame's results to the result sink
+///
+/// The binary and shared memory sinks copy the fixed-size record and
+/// never allocate. Records of inputs tracked at once are written one
+/// at a time, and with several inputs JSON lines name their input.
+///
+/// @param result results of the frame
+///
+/// @return Void
+///
+void emitFrameResult(FrameResult &result) {
+
+	int i;
+	std::lock_guard<std::mutex> guard(resultLock);
+	if (resultSinkFlag == SINK_JSONL) {
+		printf("{\"frame\":%u,\"t\":%.6f,", result.frameIndex, result.timestamp);
+		if (nInputs > 1) {
+			printf("\"camera\":%d,", result.camera);
+		}
+		printf("\"cc\":[");
+		for (i = 0; i < 3; i++) {
+			CCResult &cc = result.cc[i];
+			if (cc.found == 0) {
+				printf("%s{\"code\":%d,\"found\":0}", i ? "," : "", i);
+			} else {
+				printf("%s{\"code\":%d,\"found\":1,\"rect\":[%d,%d,%d,%d],\"confidence\":%.3f,\"parts\":[[%d,%d,%d,%d],[%d,%d,%d,%d]]}",
+						i ? "," : "", i, cc.rect[0], cc.rect[1], cc.rect[2], cc.rect[3], cc.confidence,
+						cc.partA[0], cc.partA[1], cc.partA[2], cc.partA[3], cc.partB[0], cc.partB[1], cc.partB[2], cc.partB[3]);
+			}
+		}
+		printf("]");
+		if (multiCCFlag == 1) {
+			printf(",\"instances\":[");
+			for (i = 0; i < result.nInstances; i++) {
+				CCResult &cc = result.instances[i].cc;
+				printf("%s{\"code\":%d,\"rect\":[%d,%d,%d,%d],\"confidence\":%.3f,\"parts\":[[%d,%d,%d,%d],[%d,%d,%d,%d]]}",
+						i ? "," : "", result.instances[i].code, cc.rect[0], cc.rect[1], cc.rect[2], cc.rect[3], cc.confidence,
+						cc.partA[0], cc.partA[1], cc.partA[2], cc.partA[3], cc.partB[0], cc.partB[1], cc.partB[2], cc.partB[3]);
+			}
+			printf("]");
+		}
+		printf("}\n");
+		fflush(stdout); // consumers may be reading a pipe
+	} else if (resultSinkFlag == SINK_BINARY) {
+		fwrite(&result, sizeof(result), 1, resultFile);
+		fflush(resultFile);
+	} else if (resultSinkFlag == SINK_SHM) {
+		uint64_t n = resultShm->writeCount.load(std::memory_order_relaxed); // only written here, under resultLock
+		resultShm->startCount.store(n + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release); // a reader seeing any of the new record sees startCount too
+		resultShm->records[n % SHMRINGSIZE] = result;
+		resultShm->writeCount.store(n + 1, std::memory_order_release);
+	}
+}
+
+
+/// @brief Reserve PAIRRESERVE rects or pairs in the rect and pairing
+/// buffers of a thread's scratch
+///
+/// Called at the thread's first frame, so a frame with more blobs than
+/// any before it later on does not grow them.
+///
+/// @param scratch the thread's scratch
+///
+/// @return Void
+///
+void reserveTrackerScratch(TrackerScratch &scratch) {
+
+	int ch;
+	for (ch = 0; ch < 3; ch++) {
+		scratch.filteredRects[ch].reserve(PAIRRESERVE);
+		scratch.usedRects[ch].reserve(PAIRRESERVE);
+		scratch.coarseRects[ch].reserve(PAIRRESERVE);
+		scratch.channels[ch].rects.reserve(PAIRRESERVE);
+		scratch.channels[ch].blobs.reserve(PAIRRESERVE); // labelBlobs
+		scratch.channels[ch].prevRuns.reserve(PAIRRESERVE);
+		scratch.channels[ch].curRuns.reserve(PAIRRESERVE);
+		scratch.channels[ch].parent.reserve(PAIRRESERVE);
+		scratch.channels[ch].stats.reserve(PAIRRESERVE);
+	}
+	scratch.searchRegions.reserve(PAIRRESERVE);
+	scratch.chosen.reserve(PAIRRESERVE);
+	scratch.matches.reserve(PAIRRESERVE);
+	scratch.coarsePairs.reserve(PAIRRESERVE);
+}
+
+
+/// @brief Get the parts of the frame to search for color codes
+///
+/// Outside ROI mode, or when a full frame search is due, this is the
+/// whole frame. Otherwise it is the window predicted by each color
+/// code's track, clipped to the frame, and windows that overlap are
+/// merged so no pixel is processed twice.
+///
+/// @param frameSize size of the input frame
+/// @param regions vector that gets the search windows
+///
+/// @return 1 if the whole frame is to be searched, 0 if only windows
+///
+int getSearchRegions(Size frameSize, vector<Rect> &regions) {
+
+	int i;
+	Rect frameRect(0, 0, frameSize.width, frameSize.height);
+	regions.clear();
+	// windows follow one instance per code, so -multi searches the whole frame
+	if(frameRoiMode == 1 && multiCCFlag == 0 && tracker->trackLostFlag == 0 && tracker->framesSinceFullSearch < ROIREFRESHPERIOD) {
+		for(i=0;i<3;i++) {
+			if(tracker->ccTracks[i].activeFlag == 1) {
+				regions.push_back(tracker->ccTracks[i].window);
+			}
+		}
+	}
+	if(regions.size() == 0) {
+		regions.push_back(frameRect);
+		return 1;
+	}
+	mergeSearchRegions(frameSize, regions);
+	if(regions.size() == 0) {
+		regions.push_back(frameRect);
+		return 1;
+	}
+	return 0;
+}
+
+
+/// @brief Clip search windows to the frame and merge the ones that
+/// overlap, so no pixel is processed twice
+///
+/// @param frameSize size of the input frame
+/// @param regions search windows, windows outside the frame are dropped
+///
+/// @return Void
+///
+void mergeSearchRegions(Size frameSize, vector<Rect> &regions) {
+
+	int i, j, mergedFlag;
+	Rect frameRect(0, 0, frameSize.width, frameSize.height);
+	for(i=0;i<regions.size();i++) {
+		regions[i] &= frameRect;
+	}
+	// merge overlapping windows until none overlap
+	do {
+		mergedFlag = 0;
+		for(i=0;i<regions.size() && mergedFlag == 0;i++) {
+			for(j=i+1;j<regions.size();j++) {
+				if((regions[i] & regions[j]).area() > 0) {
+					regions[i] |= regions[j];
+					regions.erase(regions.begin() + j);
+					mergedFlag = 1;
+					break;
+				}
+			}
+		}
+	} while(mergedFlag == 1);
+	for(i=regions.size()-1;i>=0;i--) { // drop windows that fell outside the frame
+		if(regions[i].area() <= 0) {
+			regions.erase(regions.begin() + i);
+		}
+	}
+}
+
+
+/// @brief Replace a full frame search with windows around the color
+/// codes found at 1/pyramidScale resolution
+///
+/// The frame is sampled at the centre of every pyramidScale x
+/// pyramidScale block, thresholded without eroding and labelled. Blobs
+/// of at least MINAREABLOB full resolution pixels are dilated like the
+/// full resolution rects, and every pair of them that makes up a color
+/// code becomes a window PYRAMIDPAD coarse pixels larger than the pair.
+/// Sampling rather than averaging keeps the colors at the boundary of
+/// the two halves of a marker apart. No windows are left if no
+/// candidate was found. Samples of YUYV and 4:2:0 frames are kept as
+/// Y, U, V and thresholded with yuvLUT.
+///
+/// @param MINHSV minimum HSV thresholds for 3 channels [H S V]
+/// @param MAXHSV maximum HSV thresholds for 3 channels [H S V]
+/// @param dilateFactor amount to increase rect size by [%]
+/// @param regions vector that gets the search windows
+///
+/// @return Void
+///
+void getCoarseRegions(int MINHSV[][3], int MAXHSV[][3], int dilateFactor, vector<Rect> &regions) {
+
+	int x, y, ch, c, i;
+	int n = pyramidScale;
+	int pad = PYRAMIDPAD*n;
+	int codeChannels[3][2] = {{0, 1}, {0, 2}, {1, 2}};
+	TrackerScratch &scratch = trackerScratch;
+	int yuvFlag = imgOriginal.type() != CV_8UC3;
+	Size frameSize = getFrameSize(imgOriginal);
+	Mat &coarse = scratch.coarseBGR;
+	coarse.create(frameSize.height/n, frameSize.width/n, CV_8UC3);
+	for (y = 0; y < coarse.rows; y++) {
+		uchar *dst = coarse.ptr<uchar>(y);
+		if (imgOriginal.type() == CV_8UC1) { // U V of the 2x2 block in the rows below the luma
+			const uchar *luma = imgOriginal.ptr<uchar>(y*n + n/2);
+			const uchar *chroma = imgOriginal.ptr<uchar>(frameSize.height + (y*n + n/2)/2);
+			for (x = 0; x < coarse.cols; x++) {
+				int col = x*n + n/2;
+				dst[3*x] = luma[col];
+				dst[3*x + 1] = chroma[col & ~1];
+				dst[3*x + 2] = chroma[(col & ~1) + 1];
+			}
+			continue;
+		}
+		if (imgOriginal.type() == CV_8UC2) {
+			const uchar *src = imgOriginal.ptr<uchar>(y*n + n/2);
+			for (x = 0; x < coarse.cols; x++) {
+				int col = x*n + n/2;
+				const uchar *pair = src + 4*(col >> 1); // Y0 U Y1 V
+				dst[3*x] = pair[2*(col & 1)];
+				dst[3*x + 1] = pair[1];
+				dst[3*x + 2] = pair[3];
+			}
+			continue;
+		}
+		const uchar *src = imgOriginal.ptr<uchar>(y*n + n/2) + 3*(n/2);
+		for (x = 0; x < coarse.cols; x++) {
+			dst[3*x] = src[3*n*x];
+			dst[3*x + 1] = src[3*n*x + 1];
+			dst[3*x + 2] = src[3*n*x + 2];
+		}
+	}
+	Mat *masks = scratch.coarseThresh;
+	if (frameThreshMode == THRESH_LUT || yuvFlag == 1) {
+		updateColorLUT(MINHSV, MAXHSV);
+		const uchar *lut = yuvFlag == 1 ? &yuvLUT[0] : &colorLUT[0];
+		for (ch = 0; ch < 3; ch++) {
+			masks[ch].create(coarse.rows, coarse.cols, CV_8UC1);
+		}
+		for (y = 0; y < coarse.rows; y++) {
+			uchar *dst[3] = {masks[0].ptr<uchar>(y), masks[1].ptr<uchar>(y), masks[2].ptr<uchar>(y)};
+			thresholdLUTRow(coarse.ptr<uchar>(y), coarse.cols, lut, dst);
+		}
+	} else {
+		cvtColor(coarse, scratch.coarseHSV, CV_BGR2HSV);
+		thresholdHSV3(scratch.coarseHSV, MINHSV, MAXHSV, masks[0], masks[1], masks[2]);
+	}
+	for (ch = 0; ch < 3; ch++) {
+		vector<BlobInfo> &blobs = scratch.channels[ch].blobs;
+		vector<Rect> &rects = scratch.coarseRects[ch];
+		labelBlobs(masks[ch], blobs, Point(0, 0), scratch.channels[ch]);
+		rects.clear();
+		for (i = 0; i < blobs.size(); i++) {
+			Rect rect(blobs[i].rect.x*n, blobs[i].rect.y*n, blobs[i].rect.width*n, blobs[i].rect.height*n);
+			if (rect.area() > MINAREABLOB) {
+				rects.push_back(rect);
+			}
+		}
+		dilateRects(dilateFactor, rects);
+		scratch.usedRects[ch].assign(rects.size(), 0);
+	}
+	scratch.coarsePairs.clear();
+	for (c = 0; c < 3; c++) {
+		getOverlapPairs(scratch.coarseRects[codeChannels[c][0]], scratch.coarseRects[codeChannels[c][1]],
+				scratch.usedRects[codeChannels[c][0]], scratch.usedRects[codeChannels[c][1]], scratch.coarsePairs, c);
+	}
+	regions.clear();
+	for (i = 0; i < scratch.coarsePairs.size(); i++) {
+		Rect &rect = scratch.coarsePairs[i].rect;
+		regions.push_back(Rect(rect.x - pad, rect.y - pad, rect.width + 2*pad, rect.height + 2*pad));
+	}
+	mergeSearchRegions(frameSize, regions);
+}
+
+
+/// @brief Size of a frame in pixels
+///
+/// 4:2:0 frames are kept in the NV12 layout OpenCV uses: a CV_8UC1 Mat
+/// of the luma rows followed by half as many rows of interleaved U, V
+/// samples, one pair for every 2x2 pixels.
+///
+/// @param frame BGR, YUYV or 4:2:0 frame
+///
+/// @return width and height of the picture
+///
+Size getFrameSize(Mat &frame) {
+
+	if (frame.type() == CV_8UC1) {
+		return Size(frame.cols, frame.rows*2/3);
+	}
+	return frame.size();
+}
+
+
+/// @brief Threshold, erode, get and dilate the bounding rectangles of
+/// all 3 channels inside one search window of the current frame
+///
+/// Rectangles are in full frame coordinates and are appended to the
+/// vectors. The per-channel stages run on channelPool when more than
+/// one thread is configured. In a YUYV frame the window is widened to
+/// start and end on a pixel pair, and it is thresholded with yuvLUT in
+/// the fused and LUT modes. In a 4:2:0 frame the window is widened to
+/// whole 2x2 blocks and thresholded, eroded and labelled at chroma
+/// resolution in every mode.
+///
+/// @param region search window in imgOriginal
+/// @param MINHSV minimum HSV thresholds for 3 channels [H S V]
+/// @param MAXHSV maximum HSV thresholds for 3 channels [H S V]
+/// @param dilateFactor amount to increase rect size by [%]
+/// @param rectsCh1 bounding rectangles found for channel 1
+/// @param rectsCh2 bounding rectangles found for channel 2
+/// @param rectsCh3 bounding rectangles found for channel 3
+///
+/// @return Void
+///
+void getRegionRects(Rect region, int MINHSV[][3], int MAXHSV[][3], int dilateFactor, vector<Rect> &rectsCh1, vector<Rect> &rectsCh2, vector<Rect> &rectsCh3) {
+
+	int ch;
+	int yuyvFlag = imgOriginal.type() == CV_8UC2;
+	int planarFlag = imgOriginal.type() == CV_8UC1;
+	Size frameSize = getFrameSize(imgOriginal);
+	int scale = planarFlag == 1 ? 2 : 1;
+	if (yuyvFlag == 1 || planarFlag == 1) {
+		int x2 = std::min(region.x + region.width + 1, frameSize.width) & ~1;
+		region.x &= ~1;
+		region.width = x2 - region.x;
+	}
+	if (planarFlag == 1) {
+		int y2 = std::min(region.y + region.height + 1, frameSize.height) & ~1;
+		region.y &= ~1;
+		region.height = y2 - region.y;
+	}
+	// a window is a view into imgOriginal, the outputs are views of the
+	// top left corner of frame sized Mats, so windows of a new size do
+	// not reallocate them and erode never reads pixels outside the window
+	Mat myImgBGR = planarFlag == 1 ? imgOriginal.rowRange(0, frameSize.height)(region) : imgOriginal(region);
+	Mat myChroma;
+	if (planarFlag == 1) {
+		Mat chromaPlane(frameSize.height/2, frameSize.width/2, CV_8UC2, imgOriginal.ptr<uchar>(frameSize.height), imgOriginal.step);
+		myChroma = chromaPlane(Rect(region.x/2, region.y/2, region.width/2, region.height/2));
+	}
+	Rect bufferRect(0, 0, region.width/scale, region.height/scale);
+	imgHSV.create(frameSize, CV_8UC3); // no-op once allocated
+	imgThreshCh1.create(frameSize, CV_8UC1);
+	imgThreshCh2.create(frameSize, CV_8UC1);
+	imgThreshCh3.create(frameSize, CV_8UC1);
+	// row buffers for the widest window, so a wider one later does not grow them
+	trackerScratch.thresholdRows.reserve(10*frameSize.width);
+	for (ch = 0; ch < 3; ch++) {
+		trackerScratch.channels[ch].erodeRows.reserve(4*frameSize.width);
+	}
+	ChannelJob job;
+	job.region = region;
+	job.scratch = &trackerScratch;
+	job.scale = scale;
+	job.threshMode = frameThreshMode;
+	job.MINHSV = MINHSV;
+	job.MAXHSV = MAXHSV;
+	job.dilateFactor = dilateFactor;
+	job.hsv = imgHSV(bufferRect);
+	job.thresh[0] = imgThreshCh1(bufferRect);
+	job.thresh[1] = imgThreshCh2(bufferRect);
+	job.thresh[2] = imgThreshCh3(bufferRect);
+	job.rects[0] = &rectsCh1;
+	job.rects[1] = &rectsCh2;
+	job.rects[2] = &rectsCh3;
+
+	// stages shared by all channels
+	if (planarFlag == 1) {
+		updateColorLUT(MINHSV, MAXHSV); // only rebuilds if thresholds changed
+		StageTimer timer(STAGE_THRESHOLD);
+		thresholdErode3(myImgBGR, myChroma, THRESHSRC_NV12, MINHSV, MAXHSV, job.thresh[0], job.thresh[1], job.thresh[2], trackerScratch.thresholdRows);
+	} else if (yuyvFlag == 1 && frameThreshMode != THRESH_INRANGE) {
+		updateColorLUT(MINHSV, MAXHSV); // only rebuilds if thresholds changed
+		StageTimer timer(STAGE_THRESHOLD);
+		thresholdErode3(myImgBGR, Mat(), THRESHSRC_YUYV, MINHSV, MAXHSV, job.thresh[0], job.thresh[1], job.thresh[2], trackerScratch.thresholdRows);
+	} else if (frameThreshMode == THRESH_LUT) {
+		updateColorLUT(MINHSV, MAXHSV); // only rebuilds if thresholds changed
+		StageTimer timer(STAGE_THRESHOLD);
+		thresholdErode3(myImgBGR, Mat(), THRESHSRC_BGR, MINHSV, MAXHSV, job.thresh[0], job.thresh[1], job.thresh[2], trackerScratch.thresholdRows);
+	} else {
+		{
+			StageTimer timer(STAGE_CVTCOLOR);
+			if (yuyvFlag == 1) {
+				trackerScratch.yuyvBGR.create(frameSize, CV_8UC3);
+				Mat bgr = trackerScratch.yuyvBGR(bufferRect);
+				cvtColor(myImgBGR, bgr, CV_YUV2BGR_YUYV);
+				cvtColor(bgr, job.hsv, CV_BGR2HSV);
+			} else {
+				cvtColor(myImgBGR, job.hsv, CV_BGR2HSV);
+			}
+		}
+		if (frameThreshMode == THRESH_FUSED) {
+			// read each HSV pixel once and write all three eroded channel masks
+			StageTimer timer(STAGE_THRESHOLD);
+			thresholdErode3(job.hsv, Mat(), THRESHSRC_HSV, MINHSV, MAXHSV, job.thresh[0], job.thresh[1], job.thresh[2], trackerScratch.thresholdRows);
+		}
+	}
+	// independent per-channel stages
+	runParallel(channelPool, 3, processChannel, &job);
+}
+
+
+/// @brief Run the per-channel stages of one search window: inRange and
+/// erode (unless already thresholded and eroded), getThresholdRects and
+/// dilateRects
+///
+/// Only touches its own channel's mask and rect vector, so the 3
+/// channels can run at the same time.
+///
+/// @param arg ChannelJob of the search window
+/// @param ch channel index 0..2
+///
+/// @return Void
+///
+void processChannel(void *arg, int ch) {
+
+	ChannelJob *job = (ChannelJob*)arg;
+	ChannelScratch &scratch = job->scratch->channels[ch]; // trackerScratch is per thread
+	Mat &myThresh = job->thresh[ch];
+	vector<Rect> &myRects = scratch.rects;
+	myRects.clear();
+	if (job->threshMode == THRESH_INRANGE && job->scale == 1) { // 4:2:0 masks are done
+		{
+			StageTimer timer(STAGE_INRANGE1 + ch);
+			inRange(job->hsv, Scalar(job->MINHSV[ch][0], job->MINHSV[ch][1], job->MINHSV[ch][2]), Scalar(job->MAXHSV[ch][0], job->MAXHSV[ch][1], job->MAXHSV[ch][2]), myThresh);
+		}
+		//GaussianBlur(myThresh, myThresh, cv::Size(3, 3), 0); // take out?
+		StageTimer timer(STAGE_ERODE);
+		erodeMask(myThresh, myThresh, scratch.erodeRows);
+	}
+	{
+		StageTimer timer(STAGE_RECTS);
+		getThresholdRects(myThresh, myRects, job->region.tl(), job->scale, scratch);
+	}
+	{
+		StageTimer timer(STAGE_DILATE);
+		dilateRects(job->dilateFactor, myRects);
+	}
+	job->rects[ch]->insert(job->rects[ch]->end(), myRects.begin(), myRects.end());
+}
+
+
+/// @brief Move every color code track on by one frame and predict its
+/// search window
+///
+/// The window is the last detected size enlarged by ROIEXPAND percent,
+/// plus KALMANSIGMAS std devs of the predicted centre on every side,
+/// centred on the predicted position. It follows a moving marker and
+/// grows while the marker is not seen.
+///
+/// @param frameSize size of the input frame
+///
+/// @return Void
+///
+void predictCCTracks(Size frameSize) {
+
+	int i, a;
+	double q = KALMANACCEL*KALMANACCEL;
+	for(i=0;i<3;i++) {
+		CCTrack &track = tracker->ccTracks[i];
+		if(track.activeFlag == 0) {
+			continue;
+		}
+		double halfSize[2] = {track.size.width*(100 + ROIEXPAND)/200.0, track.size.height*(100 + ROIEXPAND)/200.0};
+		for(a=0;a<2;a++) {
+			double *c = track.cov[a];
+			// x' = F x, P' = F P F^T + Q with F = [1 1; 0 1] and white acceleration noise
+			track.pos[a] += track.vel[a];
+			c[0] += 2*c[1] + c[2] + q/4;
+			c[1] += c[2] + q/2;
+			c[2] += q;
+			halfSize[a] += KALMANSIGMAS*sqrt(c[0]);
+		}
+		track.window = Rect(cvRound(track.pos[0] - halfSize[0]), cvRound(track.pos[1] - halfSize[1]),
+				cvRound(2*halfSize[0]), cvRound(2*halfSize[1]));
+	}
+}
+
+
+/// @brief Correct the color code tracks with the detections of this
+/// frame so the next frame can search around them
+///
+/// A detected code starts a track at rest, or corrects the predicted
+/// position and velocity of its track. A code that is missing from a
+/// full frame search is no longer followed. One missing from a window
+/// search keeps being predicted for up to KALMANMAXMISSED frames
+/// (its window grows meanwhile), then the track is considered lost and
+/// the next frame searches everything.
+///
+/// @param ccRects color code rectangles found in this frame
+/// @param foundFlags 1 for each color code found in this frame
+/// @param fullSearchFlag 1 if this frame was searched in full
+///
+/// @return Void
+///
+void updateCCTracks(Rect ccRects[], int foundFlags[], int fullSearchFlag) {
+
+	int i, a;
+	double r = KALMANNOISE*KALMANNOISE;
+	tracker->trackLostFlag = 0;
+	for(i=0;i<3;i++) {
+		CCTrack &track = tracker->ccTracks[i];
+		if(foundFlags[i] == 0) {
+			if(track.activeFlag == 1 && fullSearchFlag == 0 && ++track.nMissed <= KALMANMAXMISSED) {
+				continue; // bridge the dropout
+			}
+			if(track.activeFlag == 1 && fullSearchFlag == 0) {
+				tracker->trackLostFlag = 1;
+			}
+			track.activeFlag = 0;
+			continue;
+		}
+		double centre[2] = {ccRects[i].x + ccRects[i].width/2.0, ccRects[i].y + ccRects[i].height/2.0};
+		track.size = ccRects[i].size();
+		track.nMissed = 0;
+		if(track.activeFlag == 0) {
+			// at rest, with the velocity unknown to about the marker size per frame
+			for(a=0;a<2;a++) {
+				double vr = std::max(track.size.width, track.size.height);
+				track.pos[a] = centre[a];
+				track.vel[a] = 0;
+				track.cov[a][0] = r;
+				track.cov[a][1] = 0;
+				track.cov[a][2] = vr*vr;
+			}
+			track.activeFlag = 1;
+			continue;
+		}
+		for(a=0;a<2;a++) {
+			// measurement of the position only, H = [1 0]
+			double *c = track.cov[a];
+			double innovation = centre[a] - track.pos[a];
+			double gainPos = c[0]/(c[0] + r);
+			double gainVel = c[1]/(c[0] + r);
+			track.pos[a] += gainPos*innovation;
+			track.vel[a] += gainVel*innovation;
+			c[2] -= gainVel*c[1];
+			c[1] -= gainVel*c[0];
+			c[0] -= gainPos*c[0];
+		}
+	}
+	if(fullSearchFlag == 1) {
+		tracker->framesSinceFullSearch = 0;
+	} else {
+		tracker->framesSinceFullSearch++;
+	}
+}
+
+
+/// @brief Erode one row of a binary mask with a 3x3 square
+///
+/// Takes the minimum down each column of the 3 rows, then across each
+/// 3 columns, 16 pixels at a time with SSE2. Pixels past the ends of
+/// the row count as 255. Pass the row itself as above or below at the
+/// top and bottom of the image.
+///
+/// @param above row above
+/// @param cur row to erode
+/// @param below row below
+/// @param colMins scratch row
+/// @param out eroded row, may not be one of the inputs
+/// @param cols pixels in a row
+///
+/// @return Void
+///
+static inline void erodeRow(const uchar *above, const uchar *cur, const uchar *below, uchar *colMins, uchar *out, int cols) {
+	int x = 0;
+#if defined(__SSE2__)
+	for (; x <= cols - 16; x += 16) {
+		__m128i m = _mm_min_epu8(_mm_loadu_si128((const __m128i*)(above + x)), _mm_loadu_si128((const __m128i*)(below + x)));
+		_mm_storeu_si128((__m128i*)(colMins + x), _mm_min_epu8(m, _mm_loadu_si128((const __m128i*)(cur + x))));
+	}
+#endif
+	for (; x < cols; x++) {
+		colMins[x] = std::min(cur[x], std::min(above[x], below[x]));
+	}
+	if (cols == 1) {
+		out[0] = colMins[0];
+		return;
+	}
+	out[0] = std::min(colMins[0], colMins[1]);
+	x = 1;
+#if defined(__SSE2__)
+	for (; x <= cols - 17; x += 16) { // reads x-1 .. x+16
+		__m128i m = _mm_min_epu8(_mm_loadu_si128((const __m128i*)(colMins + x - 1)), _mm_loadu_si128((const __m128i*)(colMins + x + 1)));
+		_mm_storeu_si128((__m128i*)(out + x), _mm_min_epu8(m, _mm_loadu_si128((const __m128i*)(colMins + x))));
+	}
+#endif
+	for (; x < cols - 1; x++) {
+		out[x] = std::min(colMins[x - 1], std::min(colMins[x], colMins[x + 1]));
+	}
+	out[cols - 1] = std::min(colMins[cols - 2], colMins[cols - 1]);
+}
+
+
+/// @brief Threshold an HSV image against all 3 channels in a single pass
+///
+/// Produces the same masks as calling inRange once per channel, but
+/// every HSV pixel is read only once. With SSSE3 (or any AVX2 build)
+/// 16 pixels are deinterleaved into H, S and V vectors per iteration
+/// and compared with unsigned min/max; the remainder of each row and
+/// builds without SSSE3 use the scalar loop. The 3-channel deinterleave
+/// does not map well onto 256-bit lanes, so AVX2 builds use the same
+/// 128-bit path. Each row is done by thresholdHSV3Row.
+///
+/// @param myImgHSV 8-bit HSV image
+/// @param MINHSV minimum HSV thresholds for 3 channels [H S V]
+/// @param MAXHSV maximum HSV thresholds for 3 channels [H S V]
+/// @param myThresh1 output mask for channel 1 (255 in range, 0 otherwise)
+/// @param myThresh2 output mask for channel 2
+/// @param myThresh3 output mask for channel 3
+///
+/// @return Void
+///
+void thresholdHSV3(Mat myImgHSV, int MINHSV[][3], int MAXHSV[][3], Mat &myThresh1, Mat &myThresh2, Mat &myThresh3) {
+
+	int y;
+	uchar lo[3][3], hi[3][3];
+	getHSVBounds(MINHSV, MAXHSV, lo, hi);
+	myThresh1.create(myImgHSV.rows, myImgHSV.cols, CV_8UC1);
+	myThresh2.create(myImgHSV.rows, myImgHSV.cols, CV_8UC1);
+	myThresh3.create(myImgHSV.rows, myImgHSV.cols, CV_8UC1);
+	for (y = 0; y < myImgHSV.rows; y++) {
+		uchar *dst[3] = { myThresh1.ptr<uchar>(y), myThresh2.ptr<uchar>(y), myThresh3.ptr<uchar>(y) };
+		thresholdHSV3Row(myImgHSV.ptr<uchar>(y), myImgHSV.cols, lo, hi, dst);
+	}
+}
+
+
+/// @brief Clamp the HSV thresholds of 3 channels to 8 bits
+///
+/// A channel with an unreachable range gets lo > hi and selects
+/// nothing, the same as inRange.
+///
+/// @param MINHSV minimum HSV thresholds for 3 channels [H S V]
+/// @param MAXHSV maximum HSV thresholds for 3 channels [H S V]
+/// @param lo gets the lower bounds
+/// @param hi gets the upper bounds
+///
+/// @return Void
+///
+void getHSVBounds(int MINHSV[][3], int MAXHSV[][3], uchar lo[][3], uchar hi[][3]) {
+
+	int ch, a;
+	for (ch = 0; ch < 3; ch++) {
+		for (a = 0; a < 3; a++) {
+			if (MINHSV[ch][a] > MAXHSV[ch][a] || MINHSV[ch][a] > 255 || MAXHSV[ch][a] < 0) {
+				lo[ch][a] = 255; hi[ch][a] = 0;
+			} else {
+				lo[ch][a] = (uchar)(MINHSV[ch][a] < 0 ? 0 : MINHSV[ch][a]);
+				hi[ch][a] = (uchar)(MAXHSV[ch][a] > 255 ? 255 : MAXHSV[ch][a]);
+			}
+		}
+	}
+}
+
+
+/// @brief Threshold one row of an HSV image against all 3 channels
+///
+/// @param src row of 8-bit HSV pixels
+/// @param cols pixels in the row
+/// @param lo lower bounds from getHSVBounds
+/// @param hi upper bounds from getHSVBounds
+/// @param dst row of each channel's mask (255 in range, 0 otherwise)
+///
+/// @return Void
+///
+void thresholdHSV3Row(const uchar *src, int cols, uchar lo[][3], uchar hi[][3], uchar *dst[3]) {
+
+	int x, ch;
+#if defined(__SSSE3__)
+	int a;
+	// shuffle masks gathering every third byte of 3 consecutive 16 byte blocks
+	const __m128i shH0 = _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+	const __m128i shH1 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1);
+	const __m128i shH2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13);
+	const __m128i shS0 = _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+	const __m128i shS1 = _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1);
+	const __m128i shS2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14);
+	const __m128i shV0 = _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+	const __m128i shV1 = _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1);
+	const __m128i shV2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15);
+	__m128i vLo[3][3], vHi[3][3];
+	for (ch = 0; ch < 3; ch++) {
+		for (a = 0; a < 3; a++) {
+			vLo[ch][a] = _mm_set1_epi8((char)lo[ch][a]);
+			vHi[ch][a] = _mm_set1_epi8((char)hi[ch][a]);
+		}
+	}
+#endif
+	x = 0;
+#if defined(__SSSE3__)
+	for (; x <= cols - 16; x += 16) {
+		__m128i b0 = _mm_loadu_si128((const __m128i*)(src + 3*x));
+		__m128i b1 = _mm_loadu_si128((const __m128i*)(src + 3*x + 16));
+		__m128i b2 = _mm_loadu_si128((const __m128i*)(src + 3*x + 32));
+		__m128i px[3];
+		px[0] = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(b0, shH0), _mm_shuffle_epi8(b1, shH1)), _mm_shuffle_epi8(b2, shH2));
+		px[1] = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(b0, shS0), _mm_shuffle_epi8(b1, shS1)), _mm_shuffle_epi8(b2, shS2));
+		px[2] = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(b0, shV0), _mm_shuffle_epi8(b1, shV1)), _mm_shuffle_epi8(b2, shV2));
+		for (ch = 0; ch < 3; ch++) {
+			__m128i in = _mm_set1_epi8(-1);
+			for (a = 0; a < 3; a++) {
+				// lo <= v <= hi  <=>  max(v,lo) == v && min(v,hi) == v
+				in = _mm_and_si128(in, _mm_cmpeq_epi8(_mm_max_epu8(px[a], vLo[ch][a]), px[a]));
+				in = _mm_and_si128(in, _mm_cmpeq_epi8(_mm_min_epu8(px[a], vHi[ch][a]), px[a]));
+			}
+			_mm_storeu_si128((__m128i*)(dst[ch] + x), in);
+		}
+	}
+#endif
+	for (; x < cols; x++) {
+		uchar h = src[3*x], s = src[3*x + 1], v = src[3*x + 2];
+		for (ch = 0; ch < 3; ch++) {
+			dst[ch][x] = (h >= lo[ch][0] && h <= hi[ch][0] &&
+					s >= lo[ch][1] && s <= hi[ch][1] &&
+					v >= lo[ch][2] && v <= hi[ch][2]) ? 255 : 0;
+		}
+	}
+}
+
+
+/// @brief Rebuild the calling thread's BGR and YUV to channel bitmask
+/// lookup tables if the thresholds have changed since they were last
+/// built
+///
+/// @param MINHSV minimum HSV thresholds for 3 channels [H S V]
+/// @param MAXHSV maximum HSV thresholds for 3 channels [H S V]
+///
+/// @return Void
+///
+void updateColorLUT(int MINHSV[][3], int MAXHSV[][3]) {
+
+	int i;
+	if (lutValidFlag == 1 && memcmp(lutMIN, MINHSV, sizeof(lutMIN)) == 0 && memcmp(lutMAX, MAXHSV, sizeof(lutMAX)) == 0) {
+		return;
+	}
+	buildColorLUTs(MINHSV, MAXHSV, colorLUT, yuvLUT);
+	for (i = 0; i < 3; i++) {
+		memcpy(lutMIN[i], MINHSV[i], sizeof(lutMIN[i]));
+		memcpy(lutMAX[i], MAXHSV[i], sizeof(lutMAX[i]));
+	}
+	lutValidFlag = 1;
+}
+
+
+/// @brief Build the BGR and YUV to channel bitmask lookup tables for
+/// a set of thresholds
+///
+/// Every table cell is a BGR (YUV) color quantized to LUTBITS per
+/// component, taken at the center of its bin. The cells are converted
+/// to HSV with cvtColor, so the tables agree with the HSV path
+/// (exactly, for LUTBITS 8), and thresholded with thresholdHSV3. YUV
+/// cells go through a YUYV image with both pixels of a pair alike, so
+/// they are converted to BGR the way YUYV frames are.
+///
+/// @param MINHSV minimum HSV thresholds for 3 channels [H S V]
+/// @param MAXHSV maximum HSV thresholds for 3 channels [H S V]
+/// @param bgrTable gets the BGR table (colorLUT)
+/// @param yuvTable gets the YUV table (yuvLUT)
+///
+/// @return Void
+///
+void buildColorLUTs(int MINHSV[][3], int MAXHSV[][3], vector<uchar> &bgrTable, vector<uchar> &yuvTable) {
+
+	int y, x;
+	int nBins = 1 << LUTBITS;
+	int shift = 8 - LUTBITS;
+	int half = (1 << shift) >> 1; // bin center offset
+	// one row per (B,G) pair, one column per R
+	Mat lutBGR(nBins*nBins, nBins, CV_8UC3);
+	Mat lutHSV;
+	for (y = 0; y < lutBGR.rows; y++) {
+		uchar *p = lutBGR.ptr<uchar>(y);
+		for (x = 0; x < nBins; x++) {
+			p[3*x] = (uchar)(((y >> LUTBITS) << shift) + half);
+			p[3*x + 1] = (uchar)(((y & (nBins - 1)) << shift) + half);
+			p[3*x + 2] = (uchar)((x << shift) + half);
+		}
+	}
+	cvtColor(lutBGR, lutHSV, CV_BGR2HSV);
+	packChannelLUT(lutHSV, 1, MINHSV, MAXHSV, bgrTable);
+	// one row per (Y,U) pair, one pixel pair per V
+	Mat lutYUYV(nBins*nBins, 2*nBins, CV_8UC2);
+	for (y = 0; y < lutYUYV.rows; y++) {
+		uchar *p = lutYUYV.ptr<uchar>(y);
+		for (x = 0; x < nBins; x++) {
+			p[4*x] = p[4*x + 2] = (uchar)(((y >> LUTBITS) << shift) + half);
+			p[4*x + 1] = (uchar)(((y & (nBins - 1)) << shift) + half);
+			p[4*x + 3] = (uchar)((x << shift) + half);
+		}
+	}
+	cvtColor(lutYUYV, lutBGR, CV_YUV2BGR_YUYV);
+	cvtColor(lutBGR, lutHSV, CV_BGR2HSV);
+	packChannelLUT(lutHSV, 2, MINHSV, MAXHSV, yuvTable);
+}
+
+
+/// @brief Threshold the HSV colors of lookup table cells and pack the
+/// masks into a table of channel bitmasks
+///
+/// @param lutHSV one table row per image row, cells step pixels apart
+/// @param step pixels from one cell to the next
+/// @param MINHSV minimum HSV thresholds for 3 channels [H S V]
+/// @param MAXHSV maximum HSV thresholds for 3 channels [H S V]
+/// @param lut table that gets bit 0 for channel 1, bit 1 for channel 2
+/// and bit 2 for channel 3
+///
+/// @return Void
+///
+void packChannelLUT(Mat lutHSV, int step, int MINHSV[][3], int MAXHSV[][3], vector<uchar> &lut) {
+
+	int y, x;
+	int nCells = lutHSV.cols/step;
+	Mat lutCh1, lutCh2, lutCh3;
+	thresholdHSV3(lutHSV, MINHSV, MAXHSV, lutCh1, lutCh2, lutCh3);
+	lut.resize(lutHSV.rows*nCells);
+	for (y = 0; y < lutHSV.rows; y++) {
+		const uchar *c1 = lutCh1.ptr<uchar>(y);
+		const uchar *c2 = lutCh2.ptr<uchar>(y);
+		const uchar *c3 = lutCh3.ptr<uchar>(y);
+		uchar *dst = &lut[y*nCells];
+		for (x = 0; x < nCells; x++) {
+			dst[x] = (uchar)((c1[step*x] & 1) | (c2[step*x] & 2) | (c3[step*x] & 4));
+		}
+	}
+}
+
+
+/// @brief Threshold one row of a BGR (or Y, U, V) image against all 3
+/// channels with a color lookup table
+///
+/// One table lookup per pixel replaces the HSV conversion and the
+/// range checks. updateColorLUT must have been called first.
+///
+/// @param src row of 8-bit BGR pixels, or Y, U, V with yuvLUT
+/// @param cols pixels in the row
+/// @param lut colorLUT or yuvLUT
+/// @param dst row of each channel's mask (255 in range, 0 otherwise)
+///
+/// @return Void
+///
+void thresholdLUTRow(const uchar *src, int cols, const uchar *lut, uchar *dst[3]) {
+
+	int x;
+	const int shift = 8 - LUTBITS;
+	for (x = 0; x < cols; x++) {
+		uchar m = lut[((src[3*x] >> shift) << (2*LUTBITS)) | ((src[3*x + 1] >> shift) << LUTBITS) | (src[3*x + 2] >> shift)];
+		dst[0][x] = (uchar)-(m & 1); // 0 or 255
+		dst[1][x] = (uchar)-((m >> 1) & 1);
+		dst[2][x] = (uchar)-((m >> 2) & 1);
+	}
+}
+
+
+/// @brief Threshold one row of a YUYV image against all 3 channels with
+/// the YUV lookup table
+///
+/// The two pixels of a pair share the U and V part of their index.
+/// updateColorLUT must have been called first.
+///
+/// @param src row of packed 4:2:2 pixels (Y0 U Y1 V), starting on a pair
+/// @param cols pixels in the row, even
+/// @param dst row of each channel's mask (255 in range, 0 otherwise)
+///
+/// @return Void
+///
+void thresholdYUYVRow(const uchar *src, int cols, uchar *dst[3]) {
+
+	int x;
+	const int shift = 8 - LUTBITS;
+	const uchar *lut = &yuvLUT[0];
+	for (x = 0; x < cols; x += 2) {
+		const uchar *pair = src + 2*x;
+		int uv = ((pair[1] >> shift) << LUTBITS) | (pair[3] >> shift);
+		uchar m0 = lut[((pair[0] >> shift) << (2*LUTBITS)) | uv];
+		uchar m1 = lut[((pair[2] >> shift) << (2*LUTBITS)) | uv];
+		dst[0][x] = (uchar)-(m0 & 1); // 0 or 255
+		dst[1][x] = (uchar)-((m0 >> 1) & 1);
+		dst[2][x] = (uchar)-((m0 >> 2) & 1);
+		dst[0][x + 1] = (uchar)-(m1 & 1);
+		dst[1][x + 1] = (uchar)-((m1 >> 1) & 1);
+		dst[2][x + 1] = (uchar)-((m1 >> 2) & 1);
+	}
+}
+
+
+/// @brief Threshold one row of 2x2 blocks of a 4:2:0 image against all
+/// 3 channels with the YUV lookup table
+///
+/// Each block's U, V and the mean of its 4 luma samples give one mask
+/// pixel. updateColorLUT must have been called first.
+///
+/// @param luma0 upper luma row of the blocks
+/// @param luma1 lower luma row of the blocks
+/// @param chroma row of interleaved U, V samples
+/// @param cols blocks in the row
+/// @param dst row of each channel's mask (255 in range, 0 otherwise)
+///
+/// @return Void
+///
+void thresholdNV12Row(const uchar *luma0, const uchar *luma1, const uchar *chroma, int cols, uchar *dst[3]) {
+
+	int x;
+	const int shift = 8 - LUTBITS;
+	const uchar *lut = &yuvLUT[0];
+	for (x = 0; x < cols; x++) {
+		int luma = (luma0[2*x] + luma0[2*x + 1] + luma1[2*x] + luma1[2*x + 1] + 2) >> 2;
+		uchar m = lut[((luma >> shift) << (2*LUTBITS)) | ((chroma[2*x] >> shift) << LUTBITS) | (chroma[2*x + 1] >> shift)];
+		dst[0][x] = (uchar)-(m & 1); // 0 or 255
+		dst[1][x] = (uchar)-((m >> 1) & 1);
+		dst[2][x] = (uchar)-((m >> 2) & 1);
+	}
+}
+
+
+/// @brief Threshold an image against all 3 channels and erode the
+/// masks, writing each mask once
+///
+/// Rows are thresholded into a rolling buffer of 3 rows per channel
+/// and every mask row is eroded from the buffer as soon as the row
+/// below it is in, the same as erodeMask on the thresholded image.
+/// The thresholded masks never go to memory, and the buffer (about 10
+/// rows) stays in cache.
+///
+/// @param mySrc 8-bit HSV, BGR or YUYV image, or luma plane
+/// @param myChroma interleaved U, V plane with THRESHSRC_NV12, which
+/// gives masks of its size
+/// @param srcType THRESHSRC_HSV, or THRESHSRC_BGR, THRESHSRC_YUYV or
+/// THRESHSRC_NV12 to threshold with the lookup tables (updateColorLUT
+/// must have been called)
+/// @param MINHSV minimum HSV thresholds for 3 channels [H S V]
+/// @param MAXHSV maximum HSV thresholds for 3 channels [H S V]
+/// @param myThresh1 output eroded mask for channel 1
+/// @param myThresh2 output eroded mask for channel 2
+/// @param myThresh3 output eroded mask for channel 3
+/// @param rowBuf buffer reused between calls
+///
+/// @return Void
+///
+void thresholdErode3(Mat mySrc, Mat myChroma, int srcType, int MINHSV[][3], int MAXHSV[][3], Mat &myThresh1, Mat &myThresh2, Mat &myThresh3, vector<uchar> &rowBuf) {
+
+	int y, ch;
+	int rows = srcType == THRESHSRC_NV12 ? myChroma.rows : mySrc.rows;
+	int cols = srcType == THRESHSRC_NV12 ? myChroma.cols : mySrc.cols;
+	uchar lo[3][3], hi[3][3];
+	Mat *masks[3] = {&myThresh1, &myThresh2, &myThresh3};
+	getHSVBounds(MINHSV, MAXHSV, lo, hi);
+	for (ch = 0; ch < 3; ch++) {
+		masks[ch]->create(rows, cols, CV_8UC1);
+	}
+	if (rows == 0 || cols == 0) {
+		return;
+	}
+	rowBuf.resize(10*cols); // 3 rows of each channel, then the column minima
+	uchar *colMins = &rowBuf[9*cols];
+	for (y = -1; y < rows; y++) {
+		if (y + 1 < rows) {
+			uchar *dst[3];
+			for (ch = 0; ch < 3; ch++) {
+				dst[ch] = &rowBuf[(3*ch + (y + 1) % 3)*cols];
+			}
+			if (srcType == THRESHSRC_BGR) {
+				thresholdLUTRow(mySrc.ptr<uchar>(y + 1), cols, &colorLUT[0], dst);
+			} else if (srcType == THRESHSRC_YUYV) {
+				thresholdYUYVRow(mySrc.ptr<uchar>(y + 1), cols, dst);
+			} else if (srcType == THRESHSRC_NV12) {
+				thresholdNV12Row(mySrc.ptr<uchar>(2*y + 2), mySrc.ptr<uchar>(2*y + 3), myChroma.ptr<uchar>(y + 1), cols, dst);
+			} else {
+				thresholdHSV3Row(mySrc.ptr<uchar>(y + 1), cols, lo, hi, dst);
+			}
+		}
+		if (y < 0) {
+			continue;
+		}
+		for (ch = 0; ch < 3; ch++) {
+			const uchar *cur = &rowBuf[(3*ch + y % 3)*cols];
+			const uchar *above = y > 0 ? &rowBuf[(3*ch + (y - 1) % 3)*cols] : cur;
+			const uchar *below = y + 1 < rows ? &rowBuf[(3*ch + (y + 1) % 3)*cols] : cur;
+			erodeRow(above, cur, below, colMins, masks[ch]->ptr<uchar>(y), cols);
+		}
+	}
+}
+
+
+/// @brief For a thresholded binary image get a vector of bounding rectangles
+/// corresponding to the blobs
+///
+/// Blobs come from labelBlobs, so a blob lying inside a hole of another
+/// blob is reported too (findContours with RETR_EXTERNAL dropped those).
+///
+/// A mask at 1/scale resolution was eroded by scale frame pixels on
+/// every side rather than 1, so its rects are scaled up and grown by
+/// scale-1 pixels on every side to match a full resolution mask.
+///
+/// @param myImgThresh binary image
+/// @param filteredRect vector the rectangles are appended to
+/// @param offset added to every rectangle, e.g. position of a search window
+/// @param scale frame pixels per mask pixel each way
+/// @param scratch buffers reused between calls
+///
+void getThresholdRects(Mat myImgThresh, vector<Rect> &filteredRect, Point offset, int scale, ChannelScratch &scratch) {
+
+	int i;
+	vector<BlobInfo> &blobs = scratch.blobs;
+	labelBlobs(myImgThresh, blobs, scale == 1 ? offset : Point(0, 0), scratch);
+	for (i = 0; i < blobs.size(); i++) {
+		Rect rect = blobs[i].rect;
+		if (scale > 1) {
+			rect = Rect(offset.x + rect.x*scale - (scale - 1), offset.y + rect.y*scale - (scale - 1),
+					rect.width*scale + 2*(scale - 1), rect.height*scale + 2*(scale - 1));
+		}
+		if (rect.area() > MINAREABLOB) {
+			filteredRect.push_back(rect); // append this rectangle to list of "good" blobs
+		}
+	}
+}
+
+
+/// @brief Find the root label of a run in the union-find forest
+///
+/// Uses path halving so repeated lookups stay short.
+///
+/// @param parent parent label of every label
+/// @param label label to look up
+///
+/// @return root label
+///
+static inline int findRootLabel(vector<int> &parent, int label) {
+	while (parent[label] != label) {
+		parent[label] = parent[parent[label]];
+		label = parent[label];
+	}
+	return label;
+}
+
+
+/// @brief Get the bounding rectangle and pixel count of every
+/// 8-connected blob in a binary image
+///
+/// One raster pass finds the runs of nonzero pixels in each row and
+/// joins every run with the runs it touches in the row above using
+/// union-find, while accumulating each run's extent and pixel count on
+/// its label. The labels are then folded into their roots. No contours
+/// or label image are produced.
+///
+/// @param myImgThresh binary image, any nonzero pixel is foreground
+/// @param blobs vector that gets one entry per blob (cleared first)
+/// @param offset added to every rectangle, e.g. position of a search window
+/// @param scratch run and label buffers reused between calls
+///
+/// @return number of blobs
+///
+int labelBlobs(Mat myImgThresh, vector<BlobInfo> &blobs, Point offset, ChannelScratch &scratch) {
+
+	int x, y, i, j, k, root, other;
+	int cols = myImgThresh.cols;
+	vector<BlobRun> &prevRuns = scratch.prevRuns;
+	vector<BlobRun> &curRuns = scratch.curRuns;
+	vector<int> &parent = scratch.parent;
+	vector<BlobInfo> &stats = scratch.stats; // extent kept as x1,y1,x2,y2 in rect until the end
+
+	blobs.clear();
+	prevRuns.clear();
+	parent.clear();
+	stats.clear();
+	for (y = 0; y < myImgThresh.rows; y++) {
+		const uchar *row = myImgThresh.ptr<uchar>(y);
+		curRuns.clear();
+		j = 0; // first run of the row above that could still touch
+		x = 0;
+		while (x < cols) {
+			// skip background 8 bytes at a time
+			while (x + 8 <= cols) {
+				uint64_t word;
+				memcpy(&word, row + x, 8);
+				if (word != 0) {
+					break;
+				}
+				x += 8;
+			}
+			while (x < cols && row[x] == 0) {
+				x++;
+			}
+			if (x >= cols) {
+				break;
+			}
+			BlobRun run;
+			run.x1 = x;
+			while (x < cols && row[x] != 0) {
+				x++;
+			}
+			run.x2 = x - 1;
+			// 8-connected: runs touch if they overlap or meet diagonally
+			while (j < prevRuns.size() && prevRuns[j].x2 < run.x1 - 1) {
+				j++;
+			}
+			root = -1;
+			for (k = j; k < prevRuns.size() && prevRuns[k].x1 <= run.x2 + 1; k++) {
+				other = findRootLabel(parent, prevRuns[k].label);
+				if (root < 0) {
+					root = other;
+				} else if (other != root) {
+					parent[other] = root;
+				}
+			}
+			if (root < 0) { // new blob
+				root = parent.size();
+				parent.push_back(root);
+				BlobInfo info;
+				info.rect = Rect(run.x1, y, run.x2, y);
+				info.pixelCount = 0;
+				stats.push_back(info);
+			}
+			run.label = root;
+			BlobInfo &st = stats[root];
+			if (run.x1 < st.rect.x) { st.rect.x = run.x1; }
+			if (run.x2 > st.rect.width) { st.rect.width = run.x2; }
+			st.rect.height = y;
+			st.pixelCount += run.x2 - run.x1 + 1;
+			curRuns.push_back(run);
+		}
+		prevRuns.swap(curRuns);
+	}
+
+	// fold every label into its root, then emit the roots
+	for (i = parent.size() - 1; i >= 0; i--) {
+		root = findRootLabel(parent, i);
+		if (root != i) {
+			BlobInfo &dst = stats[root];
+			BlobInfo &src = stats[i];
+			if (src.rect.x < dst.rect.x) { dst.rect.x = src.rect.x; }
+			if (src.rect.y < dst.rect.y) { dst.rect.y = src.rect.y; }
+			if (src.rect.width > dst.rect.width) { dst.rect.width = src.rect.width; }
+			if (src.rect.height > dst.rect.height) { dst.rect.height = src.rect.height; }
+			dst.pixelCount += src.pixelCount;
+		}
+	}
+	for (i = 0; i < parent.size(); i++) {
+		if (parent[i] == i) {
+			BlobInfo info;
+			info.rect = Rect(stats[i].rect.x + offset.x, stats[i].rect.y + offset.y,
+					stats[i].rect.width - stats[i].rect.x + 1, stats[i].rect.height - stats[i].rect.y + 1);
+			info.pixelCount = stats[i].pixelCount;
+			blobs.push_back(info);
+		}
+	}
+	return blobs.size();
+}
+
+
+/// @brief Erode a binary mask with a 3x3 square, the same as erode
+/// with getStructuringElement(MORPH_RECT, Size(3, 3))
+///
+/// Pixels outside the image count as 255, like erode's default border.
+/// Source rows are copied into a rolling buffer of 3 rows and each
+/// output row is eroded from it by erodeRow, so src and dst may be the
+/// same Mat and nothing is allocated once rowBuf and dst have their
+/// size (erode builds a filter engine on the heap every call).
+///
+/// @param src binary image
+/// @param dst eroded image
+/// @param rowBuf buffer reused between calls
+///
+/// @return Void
+///
+void erodeMask(Mat src, Mat &dst, vector<uchar> &rowBuf) {
+
+	int y;
+	int rows = src.rows;
+	int cols = src.cols;
+	dst.create(rows, cols, CV_8UC1);
+	if (rows == 0 || cols == 0) {
+		return;
+	}
+	rowBuf.resize(4*cols); // 3 source rows, then the column minima
+	for (y = -1; y < rows; y++) {
+		// row y+1 is read before row y is written, for src == dst
+		if (y + 1 < rows) {
+			memcpy(&rowBuf[((y + 1) % 3)*cols], src.ptr<uchar>(y + 1), cols);
+		}
+		if (y < 0) {
+			continue;
+		}
+		const uchar *cur = &rowBuf[(y % 3)*cols];
+		const uchar *above = y > 0 ? &rowBuf[((y - 1) % 3)*cols] : cur;
+		const uchar *below = y + 1 < rows ? &rowBuf[((y + 1) % 3)*cols] : cur;
+		erodeRow(above, cur, below, &rowBuf[3*cols], dst.ptr<uchar>(y), cols);
+	}
+}
+
+
+/// @brief Dilate all the rectangles in a vector by a size percentage
+///
+/// Both the width and height are increased by the desired percentage.
+///
+/// @param Percentage factor to increase size [%]
+/// @param myRect A vector of cv::rect rectangle objects
+///
+/// @return Void
+///
+void dilateRects(int factor, vector<Rect> &myRect) {
+	int count = myRect.size();
+	int i, dW, dH;
+	for(i=0; i<count; i++) {
+		dW = myRect[i].width*factor/100;
+		dH = myRect[i].height*factor/100;
+		myRect[i].width += dW; // increase width
+		myRect[i].height += dH; // increase height
+		myRect[i].x -= dW/2;// adjust x at TL
+		myRect[i].y -= dH/2;// adjust x at TL
+							// adjust y and TL
+	}
+
+}
+
+
+/// @brief Find the 2-color-code rectangle which consists of two
+/// different colored rectangles close to each other
+///
+/// The rectangles supplied have been enlarged slightly so there is
+/// a slight overlap between the rectangles in close proximity. If
+/// more than one pair are detected, then the pair with the largest
+/// bounding rectangle by area is selected, ties going to the lowest
+/// index into rectsChA and then rectsChB.
+///
+/// Above PAIRALLPAIRSMAX candidate pairs, a sweep over rectsChB sorted
+/// by left edge limits the tests to rects whose x ranges overlap, with
+/// the same result as getCCRectBinaryAllPairs. Not reentrant, the sort
+/// order is kept in a static buffer.
+///
+/// @param rectsChA vector of bounding rectangles of first channel
+/// @param rectsChB vector of bounding rectangles of second channel
+/// @param usedA vector indicating which elements have been allocated to a CC blob
+/// @param usedB vector indicating which elements have been allocated to a CC blob
+/// @param ccRects array all the two-color-code bounding rectangles
+/// @param ccParts array of the indices into rectsChA and rectsChB making
+/// up each color code
+/// @param code ID of the current CC (color code)
+///
+/// @return 0 if successful, 1 if none detected
+///
+int getCCRectBinary(vector<Rect> &rectsChA, vector<Rect> &rectsChB, vector<int> &usedA, vector<int> &usedB, Rect ccRects[], int ccParts[][2], int code)  {
+
+	static thread_local vector<int> orderB; // indices into rectsChB by left edge
+	int i, j, k, iMax, jMax, iTarget = -1, jTarget = -1, maxArea = 0, maxWidthB = 0;
+	Rect tmpRect, selectedRect;
+	iMax = rectsChA.size();
+	jMax = rectsChB.size();
+	if (iMax*jMax <= PAIRALLPAIRSMAX) {
+		return getCCRectBinaryAllPairs(rectsChA, rectsChB, usedA, usedB, ccRects, ccParts, code);
+	}
+	orderB.reserve(PAIRRESERVE); // no-op after the first call
+	orderB.resize(jMax);
+	for (j = 0; j < jMax; j++) {
+		orderB[j] = j;
+		maxWidthB = std::max(maxWidthB, rectsChB[j].width);
+	}
+	std::sort(orderB.begin(), orderB.end(), [&rectsChB](int a, int b) { return rectsChB[a].x < rectsChB[b].x; });
+	for (i = 0; i < iMax; i++) {
+		if (usedA[i] != 0) {
+			continue;
+		}
+		Rect &rectA = rectsChA[i];
+		// first B that can reach rectA: left edge above rectA.x - maxWidthB
+		k = std::upper_bound(orderB.begin(), orderB.end(), rectA.x - maxWidthB, [&rectsChB](int x, int b) { return x < rectsChB[b].x; }) - orderB.begin();
+		for (; k < jMax && rectsChB[orderB[k]].x < rectA.x + rectA.width; k++) {
+			j = orderB[k];
+			if (usedB[j] == 0) {
+				tmpRect = rectA & rectsChB[j]; // check for overlap
+				if (tmpRect.area() > 0) {
+					tmpRect = rectA | rectsChB[j]; // get union
+					// largest union, ties to the lowest (i, j) as in the all-pairs loop
+					if (tmpRect.area() > maxArea || (tmpRect.area() == maxArea && i == iTarget && j < jTarget)) {
+						selectedRect = tmpRect;
+						iTarget = i;
+						jTarget = j;
+						maxArea = tmpRect.area();
+					}
+				}
+			}
+		}
+	}
+
+	if(maxArea>0) {
+		ccRects[code] = selectedRect;
+		ccParts[code][0] = iTarget;
+		ccParts[code][1] = jTarget;
+		usedA[iTarget] = 1; // mark this element number as used
+		usedB[jTarget] = 1;
+
+		return 0;
+	} else { return 1; }
+
+}
+
+
+/// @brief Find every color code instance made of two channels' rects
+///
+/// Rects that overlap form a bipartite graph. Each connected component
+/// of it is matched on its own: a single pair directly, and otherwise
+/// by an optimal assignment that first maximizes the number of pairs
+/// and then their total union area. Components with more than
+/// HUNGARIANMAX rects on a side are matched greedily, largest union
+/// first. Not reentrant, the scratch buffers are static.
+///
+/// @param rectsChA vector of bounding rectangles of first channel
+/// @param rectsChB vector of bounding rectangles of second channel
+/// @param usedA vector indicating which elements have been allocated to a CC blob
+/// @param usedB vector indicating which elements have been allocated to a CC blob
+/// @param matches instances found are appended to it
+/// @param code ID of the current CC (color code)
+///
+/// @return number of instances found
+///
+int getCCRectsAll(vector<Rect> &rectsChA, vector<Rect> &rectsChB, vector<int> &usedA, vector<int> &usedB, vector<CCMatch> &matches, int code) {
 
-	while (charCheckForKey != 27 && capWebcam.isOpened()) {		// until the Esc key is pressed or webcam connection is lost
-		if(getChannelFlag(charCheckForKey) != 99) {
-			channelFlag = getChannelFlag(charCheckForKey);
+	static thread_local vector<CCMatch> edges; // overlapping unused pairs
+	static thread_local vector<int> parent; // union-find over A rects then B rects
+	static thread_local vector<int> localIndex; // row or column of a rect in its component
+	static thread_local vector<int> rowToCol;
+	static thread_local vector<int64_t> cost;
+	int i, e, iMax, jMax, nFound = 0;
+	iMax = rectsChA.size();
+	jMax = rectsChB.size();
+	edges.clear();
+	getOverlapPairs(rectsChA, rectsChB, usedA, usedB, edges, code);
+	if (edges.empty()) {
+		return 0;
+	}
+	// connected components
+	parent.resize(iMax + jMax);
+	for (i = 0; i < iMax + jMax; i++) {
+		parent[i] = i;
+	}
+	for (e = 0; e < edges.size(); e++) {
+		int rootA = findRootLabel(parent, edges[e].partA);
+		int rootB = findRootLabel(parent, iMax + edges[e].partB);
+		parent[std::max(rootA, rootB)] = std::min(rootA, rootB);
+	}
+	for (i = 0; i < iMax + jMax; i++) {
+		parent[i] = findRootLabel(parent, i); // flatten, parent[] is now the component
+	}
+	// group the edges by component, in (i, j) order within each
+	std::sort(edges.begin(), edges.end(), [](const CCMatch &a, const CCMatch &b) {
+		if (parent[a.partA] != parent[b.partA]) {
+			return parent[a.partA] < parent[b.partA];
 		}
-		bool blnFrameReadSuccessfully = capWebcam.read(imgOriginal);		// get next frame
-		if (!blnFrameReadSuccessfully || imgOriginal.empty()) {		// if frame not read successfully
-			std::cout << "error: frame not read from webcam\n";		// print error message to std out
-			break;													// and jump out of while loop
+		return a.partA < b.partA || (a.partA == b.partA && a.partB < b.partB);
+	});
+	localIndex.resize(iMax + jMax);
+	int first, last;
+	for (first = 0; first < edges.size(); first = last) {
+		for (last = first + 1; last < edges.size() && parent[edges[last].partA] == parent[edges[first].partA]; last++) {
 		}
-		ticks = (double)getTickCount();
-		cvtColor(imgOriginal, imgHSV, CV_BGR2HSV);
-
-		if (trackModeFlag == 0) { // calibration mode
-			getBoundingBoxHSV(imgHSV, BBOX, HSVMINALL[channelFlag], HSVMAXALL[channelFlag]);
-			// bounding box	to show selected color region
-			rectangle(imgOriginal,
-				Point(BBOX[0], BBOX[1]),
-				Point(BBOX[2], BBOX[3]),
-				Scalar(200, 200, 200),
-				1,
-				8);
-			putText(imgOriginal, "CAL", Point(30,30), FONT_HERSHEY_PLAIN , 1.5, Scalar(12, 12, 200), 2, 8, false); // indicate tracking mode
-
-		} else if (trackModeFlag == 1) { // tracking mode
-										 // do vision processing here
-			detectCCBlobs(HSVMINALL, HSVMAXALL);
-			putText(imgOriginal, "TRACK", Point(30,30), FONT_HERSHEY_PLAIN , 1.5, Scalar(12, 12, 200), 2, 8, false); // indicate tracking mode
+		if (last - first == 1) {
+			matches.push_back(edges[first]);
+			usedA[edges[first].partA] = 1;
+			usedB[edges[first].partB] = 1;
+			nFound++;
+			continue;
 		}
-
-		imshow("imgOriginal", imgOriginal);			// show windows
-		//imshow("imgThresh", imgThresh);
-		ticks = ((double)getTickCount() - ticks)/getTickFrequency(); // time elapsed
-		if (frameCount % 60 == 0) {
-			printf("HSVMAX %d %d %d HSVMIN %d %d %d\n time %.3f\n ch %d\n", HSVMAXALL[channelFlag][0], HSVMAXALL[channelFlag][1], HSVMAXALL[channelFlag][2], HSVMINALL[channelFlag][0], HSVMINALL[channelFlag][1], HSVMINALL[channelFlag][2], ticks, channelFlag+1);
+		// number the component's rects
+		int nRows = 0, nCols = 0;
+		for (e = first; e < last; e++) {
+			localIndex[edges[e].partA] = -1;
+			localIndex[iMax + edges[e].partB] = -1;
 		}
-		frameCount++;
-		charCheckForKey = waitKey(1);			// delay (in ms) and get key press, if any
-	}	// end while
-	saveConfigFile(HSVMINALL,HSVMAXALL,3); // save HSV thresholds to config file
-	return(0);
+		for (e = first; e < last; e++) {
+			if (localIndex[edges[e].partA] < 0) {
+				localIndex[edges[e].partA] = nRows++;
+			}
+			if (localIndex[iMax + edges[e].partB] < 0) {
+				localIndex[iMax + edges[e].partB] = nCols++;
+			}
+		}
+		int n = std::max(nRows, nCols);
+		if (n <= HUNGARIANMAX) {
+			cost.assign(n*n, 0);
+			for (e = first; e < last; e++) {
+				cost[localIndex[edges[e].partA]*n + localIndex[iMax + edges[e].partB]] = -(MATCHBONUS + edges[e].rect.area());
+			}
+			solveAssignment(n, cost, rowToCol);
+			for (e = first; e < last; e++) {
+				if (rowToCol[localIndex[edges[e].partA]] == localIndex[iMax + edges[e].partB]) {
+					matches.push_back(edges[e]);
+					usedA[edges[e].partA] = 1;
+					usedB[edges[e].partB] = 1;
+					nFound++;
+				}
+			}
+		} else { // too big for an O(n^3) assignment, largest union first
+			// ties in (i, j) order, spelled out as stable_sort allocates
+			std::sort(edges.begin() + first, edges.begin() + last, [](const CCMatch &a, const CCMatch &b) {
+				if (a.rect.area() != b.rect.area()) {
+					return a.rect.area() > b.rect.area();
+				}
+				return a.partA < b.partA || (a.partA == b.partA && a.partB < b.partB);
+			});
+			for (e = first; e < last; e++) {
+				if (usedA[edges[e].partA] == 0 && usedB[edges[e].partB] == 0) {
+					matches.push_back(edges[e]);
+					usedA[edges[e].partA] = 1;
+					usedB[edges[e].partB] = 1;
+					nFound++;
+				}
+			}
+		}
+	}
+	return nFound;
 }
 
 
-/// @brief Detect 2-channel color codes blobs over 3 channels
+/// @brief List the overlapping pairs of unused rects of two channels
 ///
-/// @param MINHSV
-/// @param MAXHSV
+/// Sweeps rectsChB sorted by left edge as getCCRectBinary does, so only
+/// rects whose x ranges can overlap are tested. Pairs come out in
+/// rectsChA order. Not reentrant, the sort order is kept in a static
+/// buffer.
+///
+/// @param rectsChA vector of bounding rectangles of first channel
+/// @param rectsChB vector of bounding rectangles of second channel
+/// @param usedA vector indicating which elements have been allocated to a CC blob
+/// @param usedB vector indicating which elements have been allocated to a CC blob
+/// @param pairs pairs found are appended to it, with their union
+/// @param code ID of the current CC (color code)
 ///
 /// @return Void
 ///
-void detectCCBlobs(int MINHSV[][3], int MAXHSV[][3]) {
+void getOverlapPairs(vector<Rect> &rectsChA, vector<Rect> &rectsChB, vector<int> &usedA, vector<int> &usedB, vector<CCMatch> &pairs, int code) {
 
-	// inRange, blur, eorde, dilate, etc
-	// make a clone if required...findContours rewrites the original matrix
-	//Mat imgThreshCopy = imgThresh.clone();
-	// get the binary image
-	cv::Mat structuringElement = cv::getStructuringElement(cv::MORPH_RECT, cv::Size(3, 3));
-	// ch1
-	inRange(imgHSV, Scalar(MINHSV[0][0], MINHSV[0][1], MINHSV[0][2]), Scalar(MAXHSV[0][0], MAXHSV[0][1], MAXHSV[0][2]), imgThreshCh1);
-	//GaussianBlur(imgThreshCh1, imgThreshCh1, cv::Size(3, 3), 0); // take out?
-	erode(imgThreshCh1, imgThreshCh1, structuringElement);
-	//dilate(imgThreshCh1, imgThreshCh1, structuringElement);
-	// ch2
-	inRange(imgHSV, Scalar(MINHSV[1][0], MINHSV[1][1], MINHSV[1][2]), Scalar(MAXHSV[1][0], MAXHSV[1][1], MAXHSV[1][2]), imgThreshCh2);
-	//GaussianBlur(imgThreshCh2, imgThreshCh2, cv::Size(3, 3), 0); // take out?
-	erode(imgThreshCh2, imgThreshCh2, structuringElement);
-	//dilate(imgThreshCh2, imgThreshCh2, structuringElement);
-	// ch3
-	inRange(imgHSV, Scalar(MINHSV[2][0], MINHSV[2][1], MINHSV[2][2]), Scalar(MAXHSV[2][0], MAXHSV[2][1], MAXHSV[2][2]), imgThreshCh3);
-	//GaussianBlur(imgThreshCh3, imgThreshCh3, cv::Size(3, 3), 0); // take out?
-	erode(imgThreshCh3, imgThreshCh3, structuringElement);
-	//dilate(imgThreshCh3, imgThreshCh3, structuringElement);
+	static thread_local vector<int> orderB; // indices into rectsChB by left edge
+	int i, j, k, iMax, jMax, maxWidthB = 0;
+	iMax = rectsChA.size();
+	jMax = rectsChB.size();
+	orderB.reserve(PAIRRESERVE); // no-op after the first call
+	orderB.resize(jMax);
+	for (j = 0; j < jMax; j++) {
+		orderB[j] = j;
+		maxWidthB = std::max(maxWidthB, rectsChB[j].width);
+	}
+	std::sort(orderB.begin(), orderB.end(), [&rectsChB](int a, int b) { return rectsChB[a].x < rectsChB[b].x; });
+	for (i = 0; i < iMax; i++) {
+		if (usedA[i] != 0) {
+			continue;
+		}
+		Rect &rectA = rectsChA[i];
+		k = std::upper_bound(orderB.begin(), orderB.end(), rectA.x - maxWidthB, [&rectsChB](int x, int b) { return x < rectsChB[b].x; }) - orderB.begin();
+		for (; k < jMax && rectsChB[orderB[k]].x < rectA.x + rectA.width; k++) {
+			j = orderB[k];
+			if (usedB[j] == 0 && (rectA & rectsChB[j]).area() > 0) {
+				CCMatch pair = {code, i, j, rectA | rectsChB[j]};
+				pairs.push_back(pair);
+			}
+		}
+	}
+}
 
-	int i;
-	int dilateFactor = 35; // Amount to increase rect size by [%]
-	vector<Rect> myFilteredRects1;
-	vector<Rect> myFilteredRects2;
-	vector<Rect> myFilteredRects3;
-	Rect myCCRects[21];
-	Scalar tmpColor = Scalar(255);
-	Scalar transitColor = Scalar(0, 213, 255);
-	Scalar ch1Color = Scalar(0, 213, 255);
-	Scalar ch2Color = Scalar(181, 113, 220);
-	Scalar ch3Color = Scalar(199, 220, 113);
-	// get bounding rectangles from thresholded binary images
-	getThresholdRects(imgThreshCh1, myFilteredRects1);
-	getThresholdRects(imgThreshCh2, myFilteredRects2);
-	getThresholdRects(imgThreshCh3, myFilteredRects3);
 
-	// expand bounding rectangles
-	dilateRects(dilateFactor, myFilteredRects1);
-	dilateRects(dilateFactor, myFilteredRects2);
-	dilateRects(dilateFactor, myFilteredRects3);
+/// @brief Share the channel rects out between all 3 color codes so the
+/// total is best, not the order the codes are looked at
+///
+/// Every overlapping pair of every code is a candidate worth MATCHBONUS
+/// plus its union area, so more color codes win first and then larger
+/// ones. Without -multi at most one pair per code is taken: a branch
+/// and bound over the 3 codes. With -multi any number are: the pairs
+/// are split into connected groups (they share rects) and each group
+/// gets a branch and bound over taking or leaving each pair, bounded
+/// by half the sum of each free rect's best remaining pair. That sum is
+/// kept up to date as pairs are taken or passed, so a node costs O(1).
+///
+/// Both searches try the heaviest pairs first, so their first complete
+/// answer is the greedy one (code order without -multi), and they stop
+/// improving on it after ASSIGNBUDGET search nodes per frame. With
+/// -multi, groups reached after that are matched greedily.
+///
+/// @param codeRects the two channel rect vectors of each color code
+/// @param chosen gets the pairs taken
+///
+/// @return Void
+///
+void assignCCGlobal(vector<Rect> *codeRects[][2], vector<CCMatch> &chosen) {
 
-	// draw retangles for visualization
-	for(i=0;i<myFilteredRects1.size();i++) {
-		rectangle(imgOriginal, myFilteredRects1[i].tl(), myFilteredRects1[i].br(), ch1Color, 2, 8, 0); // bounding box
+	static thread_local vector<int> parent; // multi mode: union-find over all rects
+	static thread_local vector<int> usedNone[3];
+	AssignSearch &search = assignSearch;
+	int codeChannels[3][2] = {{0, 1}, {0, 2}, {1, 2}};
+	int c, e, ch;
+	int nodeBase[4] = {0, 0, 0, 0}; // first node number of each channel
+	vector<Rect> *channelRects[3] = {codeRects[0][0], codeRects[0][1], codeRects[1][1]};
+	if (search.edges.capacity() < PAIRRESERVE) { // once per thread, as in reserveTrackerScratch
+		vector<int> *intVectors[] = {&search.nodeA, &search.nodeB, &search.nodeFirst, &search.nextA, &search.nextB, &search.chosen,
+				&search.bestChosen, &search.order, &search.sortedNodeA, &search.sortedNodeB, &parent, &usedNone[0], &usedNone[1], &usedNone[2]};
+		for (e = 0; e < sizeof(intVectors)/sizeof(intVectors[0]); e++) {
+			intVectors[e]->reserve(PAIRRESERVE);
+		}
+		search.edges.reserve(PAIRRESERVE);
+		search.sortedEdges.reserve(PAIRRESERVE);
+		search.weights.reserve(PAIRRESERVE);
+		search.sortedWeights.reserve(PAIRRESERVE);
+		search.nodeUsed.reserve(PAIRRESERVE);
 	}
-	for(i=0;i<myFilteredRects2.size();i++) {
-		rectangle(imgOriginal, myFilteredRects2[i].tl(), myFilteredRects2[i].br(), ch2Color, 2, 8, 0); // bounding box
+	for (ch = 0; ch < 3; ch++) {
+		nodeBase[ch + 1] = nodeBase[ch] + channelRects[ch]->size();
+		usedNone[ch].assign(channelRects[ch]->size(), 0);
 	}
-	for(i=0;i<myFilteredRects3.size();i++) {
-		rectangle(imgOriginal, myFilteredRects3[i].tl(), myFilteredRects3[i].br(), ch3Color, 2, 8, 0); // bounding box
+	// candidate pairs of each code, heaviest first, ties to the lowest (i, j)
+	search.edges.clear();
+	for (c = 0; c < 3; c++) {
+		search.codeStart[c] = search.edges.size();
+		getOverlapPairs(*codeRects[c][0], *codeRects[c][1], usedNone[codeChannels[c][0]], usedNone[codeChannels[c][1]], search.edges, c);
+		std::sort(search.edges.begin() + search.codeStart[c], search.edges.end(), [](const CCMatch &a, const CCMatch &b) {
+			if (a.rect.area() != b.rect.area()) {
+				return a.rect.area() > b.rect.area();
+			}
+			return a.partA < b.partA || (a.partA == b.partA && a.partB < b.partB);
+		});
 	}
-
-	vector<int> usedRectsCh1(myFilteredRects1.size(),0); // keeping track of rectangles used already
-	vector<int> usedRectsCh2(myFilteredRects2.size(),0);
-	vector<int> usedRectsCh3(myFilteredRects3.size(),0);
-	// find 2-color-code blobs
-	if(getCCRectBinary(myFilteredRects1, myFilteredRects2, usedRectsCh1, usedRectsCh2, myCCRects, 0) == 0) {
-		rectangle(imgOriginal, myCCRects[0].tl(), myCCRects[0].br(), tmpColor, 2, 8, 0); // CC blob
+	search.codeStart[3] = search.edges.size();
+	int nEdges = search.edges.size();
+	search.weights.resize(nEdges);
+	search.nodeA.resize(nEdges);
+	search.nodeB.resize(nEdges);
+	for (e = 0; e < nEdges; e++) {
+		CCMatch &edge = search.edges[e];
+		search.weights[e] = MATCHBONUS + edge.rect.area();
+		search.nodeA[e] = nodeBase[codeChannels[edge.code][0]] + edge.partA;
+		search.nodeB[e] = nodeBase[codeChannels[edge.code][1]] + edge.partB;
 	}
-	if(getCCRectBinary(myFilteredRects1, myFilteredRects3, usedRectsCh1, usedRectsCh3, myCCRects, 1) == 0) {
-		rectangle(imgOriginal, myCCRects[1].tl(), myCCRects[1].br(), tmpColor, 2, 8, 0); // CC blob
+	search.nodeUsed.assign(nodeBase[3], 0);
+	search.nNodes = 0;
+	search.chosen.clear();
+	search.bestChosen.clear();
+	if (multiCCFlag == 0) {
+		search.bestWeight = -1;
+		searchAssignSingle(0, 0);
+	} else {
+		// group the pairs by connected component
+		parent.resize(nodeBase[3]);
+		for (e = 0; e < nodeBase[3]; e++) {
+			parent[e] = e;
+		}
+		for (e = 0; e < nEdges; e++) {
+			int rootA = findRootLabel(parent, search.nodeA[e]);
+			int rootB = findRootLabel(parent, search.nodeB[e]);
+			parent[std::max(rootA, rootB)] = std::min(rootA, rootB);
+		}
+		for (e = 0; e < nodeBase[3]; e++) {
+			parent[e] = findRootLabel(parent, e);
+		}
+		vector<int> &order = search.order;
+		order.resize(nEdges);
+		for (e = 0; e < nEdges; e++) {
+			order[e] = e;
+		}
+		// ties by index rather than stable_sort, which allocates
+		std::sort(order.begin(), order.end(), [&search](int a, int b) {
+			if (parent[search.nodeA[a]] != parent[search.nodeA[b]]) {
+				return parent[search.nodeA[a]] < parent[search.nodeA[b]];
+			}
+			if (search.weights[a] != search.weights[b]) {
+				return search.weights[a] > search.weights[b];
+			}
+			return a < b;
+		});
+		// reorder the edge arrays to match, swapping with the spares
+		// keeps the capacity of both
+		search.sortedEdges.resize(nEdges);
+		search.sortedWeights.resize(nEdges);
+		search.sortedNodeA.resize(nEdges);
+		search.sortedNodeB.resize(nEdges);
+		for (e = 0; e < nEdges; e++) {
+			search.sortedEdges[e] = search.edges[order[e]];
+			search.sortedWeights[e] = search.weights[order[e]];
+			search.sortedNodeA[e] = search.nodeA[order[e]];
+			search.sortedNodeB[e] = search.nodeB[order[e]];
+		}
+		search.edges.swap(search.sortedEdges);
+		search.weights.swap(search.sortedWeights);
+		search.nodeA.swap(search.sortedNodeA);
+		search.nodeB.swap(search.sortedNodeB);
+		// the next, so next heaviest, pair at both rects of every pair
+		search.nodeFirst.assign(nodeBase[3], -1);
+		search.nextA.resize(nEdges);
+		search.nextB.resize(nEdges);
+		for (e = nEdges - 1; e >= 0; e--) {
+			search.nextA[e] = search.nodeFirst[search.nodeA[e]];
+			search.nextB[e] = search.nodeFirst[search.nodeB[e]];
+			search.nodeFirst[search.nodeA[e]] = e;
+			search.nodeFirst[search.nodeB[e]] = e;
+		}
+		for (search.first = 0; search.first < nEdges; search.first = search.last) {
+			int64_t sumLeft = 0, sumNodes = 0; // weight of all pairs, and of the best pair at each rect
+			for (search.last = search.first; search.last < nEdges && parent[search.nodeA[search.last]] == parent[search.nodeA[search.first]]; search.last++) {
+				e = search.last;
+				sumLeft += search.weights[e];
+				sumNodes += (search.nodeFirst[search.nodeA[e]] == e) * search.weights[e] + (search.nodeFirst[search.nodeB[e]] == e) * search.weights[e];
+			}
+			if (search.nNodes > ASSIGNBUDGET) { // out of budget, take the heaviest free pairs
+				for (e = search.first; e < search.last; e++) {
+					if (search.nodeUsed[search.nodeA[e]] == 0 && search.nodeUsed[search.nodeB[e]] == 0) {
+						search.nodeUsed[search.nodeA[e]] = 1;
+						search.nodeUsed[search.nodeB[e]] = 1;
+						search.bestChosen.push_back(e);
+					}
+				}
+				continue;
+			}
+			search.chosen.clear();
+			search.nBest = 0;
+			search.bestWeight = -1;
+			searchAssignMulti(search.first, 0, sumLeft, sumNodes); // appends the component's best to bestChosen
+		}
 	}
-	if(getCCRectBinary(myFilteredRects2, myFilteredRects3, usedRectsCh2, usedRectsCh3, myCCRects, 2) == 0) {
-		rectangle(imgOriginal, myCCRects[2].tl(), myCCRects[2].br(), tmpColor, 2, 8, 0); // CC blob
+	for (e = 0; e < search.bestChosen.size(); e++) {
+		chosen.push_back(search.edges[search.bestChosen[e]]);
 	}
-
 }
 
 
-/// @brief For a thresholded binary image get a vector of bounding rectangles
-/// corresponding to the blobs
+/// @brief Branch and bound over the pair taken for each color code,
+/// at most one per code
+///
+/// @param code color code to pick a pair for
+/// @param weight weight of the pairs taken so far
 ///
-void getThresholdRects(Mat myImgThresh, vector<Rect> &filteredRect) {
+/// @return Void
+///
+void searchAssignSingle(int code, int64_t weight) {
 
-	int i;
-	vector<vector<Point> > contours;
-	vector<Vec4i> hierarchy;
+	AssignSearch &search = assignSearch;
+	int e, c;
+	int64_t bound = weight;
+	search.nNodes++;
+	for (c = code; c < 3; c++) { // best pair left for each code
+		if (search.codeStart[c] < search.codeStart[c + 1]) {
+			bound += search.weights[search.codeStart[c]];
+		}
+	}
+	if (bound <= search.bestWeight) {
+		return;
+	}
+	if (code == 3) {
+		search.bestWeight = weight;
+		search.bestChosen = search.chosen;
+		return;
+	}
+	for (e = search.codeStart[code]; e < search.codeStart[code + 1]; e++) {
+		if (search.nodeUsed[search.nodeA[e]] == 0 && search.nodeUsed[search.nodeB[e]] == 0) {
+			search.nodeUsed[search.nodeA[e]] = 1;
+			search.nodeUsed[search.nodeB[e]] = 1;
+			search.chosen.push_back(e);
+			searchAssignSingle(code + 1, weight + search.weights[e]);
+			search.chosen.pop_back();
+			search.nodeUsed[search.nodeA[e]] = 0;
+			search.nodeUsed[search.nodeB[e]] = 0;
+			if (search.nNodes > ASSIGNBUDGET) {
+				return;
+			}
+		}
+	}
+	searchAssignSingle(code + 1, weight); // no pair for this code
+}
 
-	// findContours(imgThreshCh1, contours, hierarchy, RETR_EXTERNAL, CHAIN_APPROX_SIMPLE, Point(0, 0)); // get outermost contours
-	findContours(myImgThresh, contours, RETR_EXTERNAL, CHAIN_APPROX_SIMPLE, Point(0, 0)); // get outermost contours
 
-	vector<vector<Point> > contoursPoly(contours.size()); // to store approx polygonal curves
-	vector<Rect> boundRect(contours.size()); // to store bounding rectangles  (x,y, at TL corner)
-	for (i = 0; i < contours.size(); i++) {
-		approxPolyDP(Mat(contours[i]), contoursPoly[i], 3, true); // approx polygonal curve
-		boundRect[i] = boundingRect(Mat(contoursPoly[i]));  // bounding box
-		if (boundRect[i].area() > MINAREABLOB) {
-			filteredRect.push_back(boundRect[i]); // append this rectangle to list of "good" blobs
+/// @brief Branch and bound over taking or leaving each pair of the
+/// current connected component, any number per code
+///
+/// The best set found is appended to assignSearch.bestChosen. Leaving
+/// a pair loops rather than recursing, so the depth is the number of
+/// pairs taken.
+///
+/// @param e next pair of the component to decide on
+/// @param weight weight of the pairs taken so far
+/// @param sumLeft weight of the pairs from e on
+/// @param sumNodes sum over the free rects of their first pair from e on
+///
+/// @return Void
+///
+void searchAssignMulti(int e, int64_t weight, int64_t sumLeft, int64_t sumNodes) {
+
+	AssignSearch &search = assignSearch;
+	for (; ; e++) {
+		search.nNodes++;
+		if (e == search.last) {
+			if (weight > search.bestWeight) {
+				// replace the component's previous best at the end of bestChosen
+				search.bestChosen.resize(search.bestChosen.size() - search.nBest);
+				search.bestChosen.insert(search.bestChosen.end(), search.chosen.begin(), search.chosen.end());
+				search.nBest = search.chosen.size();
+				search.bestWeight = weight;
+			}
+			return;
+		}
+		// bound: each free rect brings at most half its best remaining pair
+		if (weight + std::min(sumLeft, sumNodes/2) <= search.bestWeight) {
+			return;
+		}
+		if (search.bestWeight >= 0 && search.nNodes > ASSIGNBUDGET) { // keep the best so far
+			return;
+		}
+		int64_t w = search.weights[e];
+		int freeA = search.nodeUsed[search.nodeA[e]] == 0;
+		int freeB = search.nodeUsed[search.nodeB[e]] == 0;
+		sumLeft -= w;
+		if (freeA && freeB) { // taking it uses up both rects
+			search.nodeUsed[search.nodeA[e]] = 1;
+			search.nodeUsed[search.nodeB[e]] = 1;
+			search.chosen.push_back(e);
+			searchAssignMulti(e + 1, weight + w, sumLeft, sumNodes - 2*w);
+			search.chosen.pop_back();
+			search.nodeUsed[search.nodeA[e]] = 0;
+			search.nodeUsed[search.nodeB[e]] = 0;
+		}
+		// leaving it, its free rects move on to their next pair
+		if (freeA) {
+			sumNodes += (search.nextA[e] >= 0 ? search.weights[search.nextA[e]] : 0) - w;
+		}
+		if (freeB) {
+			sumNodes += (search.nextB[e] >= 0 ? search.weights[search.nextB[e]] : 0) - w;
 		}
 	}
 }
 
 
-/// @brief Dilate all the rectangles in a vector by a size percentage
+/// @brief Minimum cost assignment of n rows to n columns (Hungarian
+/// method with potentials, O(n^3))
 ///
-/// Both the width and height are increased by the desired percentage.
+/// Not reentrant, the scratch buffers are static.
 ///
-/// @param Percentage factor to increase size [%]
-/// @param myRect A vector of cv::rect rectangle objects
+/// @param n number of rows and columns
+/// @param cost row-major n x n costs
+/// @param rowToCol gets the column assigned to each row
 ///
 /// @return Void
 ///
-void dilateRects(int factor, vector<Rect> &myRect) {
-	int count = myRect.size();
-	int i, dW, dH;
-	for(i=0; i<count; i++) {
-		dW = myRect[i].width*factor/100;
-		dH = myRect[i].height*factor/100;
-		myRect[i].width += dW; // increase width
-		myRect[i].height += dH; // increase height
-		myRect[i].x -= dW/2;// adjust x at TL
-		myRect[i].y -= dH/2;// adjust x at TL
-							// adjust y and TL
-	}
+void solveAssignment(int n, vector<int64_t> &cost, vector<int> &rowToCol) {
 
+	static thread_local vector<int64_t> u, v, minCost;
+	static thread_local vector<int> colToRow, prevCol;
+	static thread_local vector<char> colDone;
+	const int64_t INF = std::numeric_limits<int64_t>::max()/4;
+	int i, j;
+	// 1-based, row and column 0 are the virtual start
+	u.assign(n + 1, 0);
+	v.assign(n + 1, 0);
+	colToRow.assign(n + 1, 0);
+	prevCol.assign(n + 1, 0);
+	for (i = 1; i <= n; i++) {
+		int col = 0;
+		colToRow[0] = i;
+		minCost.assign(n + 1, INF);
+		colDone.assign(n + 1, 0);
+		do { // grow the alternating tree until a free column is reached
+			colDone[col] = 1;
+			int row = colToRow[col], nextCol = 0;
+			int64_t delta = INF;
+			for (j = 1; j <= n; j++) {
+				if (colDone[j] == 0) {
+					int64_t reduced = cost[(row - 1)*n + j - 1] - u[row] - v[j];
+					if (reduced < minCost[j]) {
+						minCost[j] = reduced;
+						prevCol[j] = col;
+					}
+					if (minCost[j] < delta) {
+						delta = minCost[j];
+						nextCol = j;
+					}
+				}
+			}
+			for (j = 0; j <= n; j++) {
+				if (colDone[j] == 1) {
+					u[colToRow[j]] += delta;
+					v[j] -= delta;
+				} else {
+					minCost[j] -= delta;
+				}
+			}
+			col = nextCol;
+		} while (colToRow[col] != 0);
+		do { // flip the augmenting path
+			int next = prevCol[col];
+			colToRow[col] = colToRow[next];
+			col = next;
+		} while (col != 0);
+	}
+	rowToCol.assign(n, -1);
+	for (j = 1; j <= n; j++) {
+		rowToCol[colToRow[j] - 1] = j - 1;
+	}
 }
 
 
-/// @brief Find the 2-color-code rectangle which consists of two
-/// different colored rectangles close to each other
-///
-/// The rectangles supplied have been enlarged slightly so there is
-/// a slight overlap between the rectangles in close proximity. If
-/// more than one pair are detected, then the pair with the largest
-/// bounding rectangle by area is selected.
+/// @brief getCCRectBinary testing every pair of rects, used for few rects
 ///
 /// @param rectsChA vector of bounding rectangles of first channel
 /// @param rectsChB vector of bounding rectangles of second channel
 /// @param usedA vector indicating which elements have been allocated to a CC blob
 /// @param usedB vector indicating which elements have been allocated to a CC blob
 /// @param ccRects array all the two-color-code bounding rectangles
+/// @param ccParts array of the indices into rectsChA and rectsChB making
+/// up each color code
 /// @param code ID of the current CC (color code)
 ///
 /// @return 0 if successful, 1 if none detected
 ///
-int getCCRectBinary(vector<Rect> &rectsChA, vector<Rect> &rectsChB, vector<int> &usedA, vector<int> &usedB, Rect ccRects[], int code)  {
+int getCCRectBinaryAllPairs(vector<Rect> &rectsChA, vector<Rect> &rectsChB, vector<int> &usedA, vector<int> &usedB, Rect ccRects[], int ccParts[][2], int code)  {
 	int i, j, iMax, jMax, iTarget, jTarget, maxArea=0;
 	Rect tmpRect, selectedRect;
 	iMax = rectsChA.size();
@@ -312,6 +4982,8 @@ int getCCRectBinary(vector<Rect> &rectsChA, vector<Rect> &rectsChB, vector<int>
 
 	if(maxArea>0) {
 		ccRects[code] = selectedRect;
+		ccParts[code][0] = iTarget;
+		ccParts[code][1] = jTarget;
 		usedA[iTarget] = 1; // mark this element number as used
 		usedB[jTarget] = 1;
 
@@ -325,7 +4997,8 @@ static void onMouse(int event, int x, int y, int f, void*) {
 
 	if (event == CV_EVENT_LBUTTONDOWN) {
 		mouseDraggedFlag = 1;
-		printf("bounding box top left (%d,%d)\n", x, y);
+		fprintf(stderr, "bounding box top left (%d,%d)\n", x, y);
+		std::lock_guard<std::mutex> guard(bboxLock);
 		BBOX[0] = x;
 		BBOX[1] = y;
 		BBOX[2] = x;
@@ -333,7 +5006,8 @@ static void onMouse(int event, int x, int y, int f, void*) {
 	}
 	else if (event == CV_EVENT_MOUSEMOVE) {
 		if (mouseDraggedFlag == 1) {
-			printf("dragging (%d,%d)\n", x, y);
+			fprintf(stderr, "dragging (%d,%d)\n", x, y);
+			std::lock_guard<std::mutex> guard(bboxLock);
 			BBOX[2] = x;
 			BBOX[3] = y;
 		}
@@ -378,35 +5052,143 @@ int getChannelFlag(char charKey) {
 /// @brief Get minimum and maximum HSV values given a Mat object
 /// and coordinates of the bounding box of interest.
 ///
-/// 8-bit int HSV values are used
+/// 8-bit int HSV values are used. The values are percentiles of the
+/// box's H, S and V histograms, calibPercentile in from each end, so
+/// outliers are left out (with 0 they are the min and max). The
+/// histograms are kept between calls and only the pixels that entered
+/// or left the box since the last call are counted, as they are when
+/// it is dragged. While the box and channel stay the same, nothing is
+/// done and the thresholds are left as they are.
 ///
 /// @param myImgObject HSV image to get HSV values from
 /// @param BOX coordinates of the upper left and bottom right corners
 /// of bounding box which indicates a color of interest [x1 y1 x2 y2]
 /// [pixels]
+/// @param channel channel being calibrated, a new one starts a new box
 /// @param MINHSV minimum HSV value from bounding box [H S V]
 /// @param MAXHSV maximum HSV value from bounding box [H S V]
 ///
 /// @return Void
 ///
-void getBoundingBoxHSV(Mat myImgHSV, int BOX[], int MINHSV[], int MAXHSV[]) {
+void getBoundingBoxHSV(Mat myImgHSV, int BOX[], int channel, int MINHSV[], int MAXHSV[]) {
 
-	int i, j, a;
-	Vec3b intensity;
+	int a;
+	CalibHistogram &calib = calibHistogram;
+	Rect box = Rect(BOX[0], BOX[1], std::max(BOX[2] - BOX[0], 0), std::max(BOX[3] - BOX[1], 0)) & Rect(0, 0, myImgHSV.cols, myImgHSV.rows);
+	if (calib.validFlag == 0 || calib.channel != channel || calib.samples.size() != myImgHSV.size()) {
+		calib.samples.create(myImgHSV.size(), CV_8UC3);
+		memset(calib.counts, 0, sizeof(calib.counts));
+		calib.box = Rect();
+		calib.channel = channel;
+		calib.validFlag = 1;
+	} else if (box == calib.box) {
+		return; // no pixel entered or left the box
+	}
+	updateCalibHistogram(myImgHSV, box);
 	// reset HSV values
 	for (a = 0;a < 3;a++) {
 		MAXHSV[a] = 0; MINHSV[a] = 255;
 	}
-	// get HSV range in selected region
-	for (i = BOX[0];i < BOX[2];i++) {
-		for (j = BOX[1];j < BOX[3];j++) {
-			intensity = myImgHSV.at<Vec3b>(j, i);
-			for (a = 0;a < 3;a++) {
-				if (intensity.val[a] > MAXHSV[a]) { MAXHSV[a] = intensity.val[a]; }
-				if (intensity.val[a] < MINHSV[a]) { MINHSV[a] = intensity.val[a]; }
-			}
+	if (box.area() == 0) {
+		return;
+	}
+	int nOutliers = (int)(box.area()*calibPercentile/100.0); // left out at each end
+	for (a = 0;a < 3;a++) {
+		MINHSV[a] = getPercentileValue(calib.counts[a], nOutliers);
+		MAXHSV[a] = getPercentileValue(calib.counts[a], box.area() - 1 - nOutliers);
+	}
+}
+
+
+/// @brief Move the calibration histograms from the box they count to
+/// another
+///
+/// Pixels that leave the box are taken out with the values they were
+/// counted with, from calibHistogram.samples, and pixels that enter it
+/// are counted and copied there. Both go row by row, so a box dragged
+/// by a few pixels costs a few rows or columns.
+///
+/// @param myImgHSV HSV image the entering pixels are read from
+/// @param box new box, within the image
+///
+/// @return Void
+///
+void updateCalibHistogram(Mat myImgHSV, Rect box) {
+
+	int y;
+	CalibHistogram &calib = calibHistogram;
+	Rect old = calib.box;
+	for (y = old.y; y < old.y + old.height; y++) {
+		uchar *row = calib.samples.ptr<uchar>(y);
+		if (y >= box.y && y < box.y + box.height) { // left and right of the new box
+			countHistogramSpan(row, NULL, old.x, std::min(old.x + old.width, box.x), -1, calib.counts);
+			countHistogramSpan(row, NULL, std::max(old.x, box.x + box.width), old.x + old.width, -1, calib.counts);
+		} else {
+			countHistogramSpan(row, NULL, old.x, old.x + old.width, -1, calib.counts);
 		}
 	}
+	for (y = box.y; y < box.y + box.height; y++) {
+		const uchar *src = myImgHSV.ptr<uchar>(y);
+		uchar *row = calib.samples.ptr<uchar>(y);
+		if (y >= old.y && y < old.y + old.height) { // left and right of the old box
+			countHistogramSpan(src, row, box.x, std::min(box.x + box.width, old.x), 1, calib.counts);
+			countHistogramSpan(src, row, std::max(box.x, old.x + old.width), box.x + box.width, 1, calib.counts);
+		} else {
+			countHistogramSpan(src, row, box.x, box.x + box.width, 1, calib.counts);
+		}
+	}
+	calib.box = box;
+}
+
+
+/// @brief Add the pixels of part of an HSV row to the H, S and V
+/// histograms, or take them out
+///
+/// @param src HSV row
+/// @param copy row the pixels are copied to when counted, NULL for none
+/// @param x0 first pixel
+/// @param x1 pixel after the last, nothing is done if not after x0
+/// @param sign 1 to add, -1 to take out
+/// @param counts H, S and V histograms
+///
+/// @return Void
+///
+void countHistogramSpan(const uchar *src, uchar *copy, int x0, int x1, int sign, int counts[][256]) {
+
+	int x;
+	if (x1 <= x0) {
+		return;
+	}
+	const uchar *p = src + 3*x0;
+	for (x = x0; x < x1; x++, p += 3) {
+		counts[0][p[0]] += sign;
+		counts[1][p[1]] += sign;
+		counts[2][p[2]] += sign;
+	}
+	if (copy != NULL) {
+		memcpy(copy + 3*x0, src + 3*x0, 3*(x1 - x0));
+	}
+}
+
+
+/// @brief Value at a rank of a 256 bin histogram
+///
+/// @param counts histogram
+/// @param rank number of values below the one wanted, 0 for the
+/// smallest, total - 1 for the largest
+///
+/// @return smallest value with more than rank values at or below it
+///
+int getPercentileValue(const int counts[], int rank) {
+
+	int v, seen = 0;
+	for (v = 0; v < 255; v++) {
+		seen += counts[v];
+		if (seen > rank) {
+			break;
+		}
+	}
+	return v;
 }
 
 
@@ -480,8 +5262,10 @@ void detectBlobs(int MINHSV[], int MAXHSV[]) {
 		}
 	}
 
-	imshow("imgThresh", imgThresh);
-	imshow("imgHSV", drawing);
+	if (headlessFlag == 0) {
+		imshow("imgThresh", imgThresh);
+		imshow("imgHSV", drawing);
+	}
 }
 
 
@@ -495,20 +5279,40 @@ void detectBlobs(int MINHSV[], int MAXHSV[]) {
 ///
 int loadConfigFile(int MIN[][3], int MAX[][3], int nChannels) {
 
+	if (readConfigFile(MIN, MAX, nChannels) != 0) {
+		fprintf(stderr, "read error!\n");
+		return 1;
+	}
+	fprintf(stderr, "done reading from config file!\n");
+	return 0;
+}
+
+
+/// @brief Read the HSV parameters of the configuration file, quietly
+///
+/// @param MIN array of arrays of minimum HSV threshold [H S V]
+/// @param MAX array of arrays of maximum HSV threshold [H S V]
+/// @param nChannels number of color channels in the config file
+///
+/// @return 0 if read successfully, 1 if the file could not be opened
+/// or a channel line is missing or malformed
+///
+int readConfigFile(int MIN[][3], int MAX[][3], int nChannels) {
+
 	int i, ch;
 	FILE *fp;
-	char INPUTPATH[] = "babyMotionConfig.txt";
+	char INPUTPATH[] = CONFIGPATH;
 	fp = fopen(INPUTPATH,"r");
 	if(fp==NULL){
-		printf("read error!\n");
 		return 1;
 	}
 	for(i=0;i<nChannels;i++) {
-		fscanf(fp,"channel %d, HSVMIN{%d,%d,%d}, HSVMAX{%d,%d,%d}\n",&ch,&MIN[i][0],&MIN[i][1],&MIN[i][2],&MAX[i][0],&MAX[i][1],&MAX[i][2]);
+		if (fscanf(fp,"channel %d, HSVMIN{%d,%d,%d}, HSVMAX{%d,%d,%d}\n",&ch,&MIN[i][0],&MIN[i][1],&MIN[i][2],&MAX[i][0],&MAX[i][1],&MAX[i][2]) != 7) {
+			break;
+		}
 	}
 	fclose(fp);
-	printf("done reading from config file!\n");
-	return 0;
+	return i == nChannels ? 0 : 1;
 }
 
 
@@ -524,16 +5328,166 @@ int saveConfigFile(int MIN[][3], int MAX[][3], int nChannels) {
 
 	int i;
 	FILE *fp;
-	char INPUTPATH[] = "babyMotionConfig.txt";
+	char INPUTPATH[] = CONFIGPATH;
 	fp = fopen(INPUTPATH,"w");
 	if(fp==NULL){
-		printf("config file write error!\n");
+		fprintf(stderr, "config file write error!\n");
 		return 1;
 	}
 	for(i=0;i<nChannels;i++) {
 		fprintf(fp,"channel %d, HSVMIN{%d,%d,%d}, HSVMAX{%d,%d,%d}\n",i,MIN[i][0],MIN[i][1],MIN[i][2],MAX[i][0],MAX[i][1],MAX[i][2]);
 	}
 	fclose(fp);
-	printf("done wiriting to config file!\n");
+	fprintf(stderr, "done wiriting to config file!\n");
+	return 0;
+}
+
+
+/// @brief Start the -reload thread that watches the config file
+///
+/// The file's directory is watched rather than the file, so the new
+/// file is seen when an editor saves by replacing it.
+///
+/// @return 0 if successful, 1 if inotify could not be set up
+///
+int startConfigWatcher() {
+
+	int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0 || inotify_add_watch(fd, ".", IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		fprintf(stderr, "could not watch %s for changes\n", CONFIGPATH);
+		if (fd >= 0) {
+			close(fd);
+		}
+		return 1;
+	}
+	watcherQuitFlag = 0;
+	configWatcherThread = std::thread(configWatcher, fd);
 	return 0;
 }
+
+
+/// @brief Stop the -reload thread, if it runs
+///
+/// @return Void
+///
+void stopConfigWatcher() {
+
+	if (configWatcherThread.joinable()) {
+		watcherQuitFlag = 1;
+		configWatcherThread.join();
+	}
+}
+
+
+/// @brief -reload thread: publish the thresholds of the config file
+/// every time it is written or replaced, until watcherQuitFlag is set
+///
+/// A file that does not parse is reported and ignored, the thresholds
+/// in use stay.
+///
+/// @param fd inotify instance watching the config file's directory
+///
+/// @return Void
+///
+void configWatcher(int fd) {
+
+	char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct pollfd watch = {fd, POLLIN, 0};
+	int MIN[3][3], MAX[3][3];
+	while (watcherQuitFlag == 0) {
+		if (poll(&watch, 1, RELOADPOLLMS) <= 0) {
+			continue;
+		}
+		int changedFlag = 0;
+		ssize_t nBytes, pos;
+		while ((nBytes = read(fd, events, sizeof(events))) > 0) {
+			for (pos = 0; pos < nBytes; pos += sizeof(struct inotify_event) + ((struct inotify_event*)(events + pos))->len) {
+				struct inotify_event *event = (struct inotify_event*)(events + pos);
+				if (event->len > 0 && strcmp(event->name, CONFIGPATH) == 0) {
+					changedFlag = 1;
+				}
+			}
+		}
+		if (changedFlag == 0) {
+			continue;
+		}
+		if (readConfigFile(MIN, MAX, 3) != 0) {
+			fprintf(stderr, "%s not reloaded, it does not parse\n", CONFIGPATH);
+			continue;
+		}
+		publishThresholds(MIN, MAX);
+		fprintf(stderr, "thresholds reloaded from %s\n", CONFIGPATH);
+	}
+	close(fd);
+}
+
+
+/// @brief Make a new set of thresholds the one processing threads pick
+/// up at their next frame
+///
+/// The set is written into the inactive buffer, with its lookup
+/// tables, after waiting for any thread still copying that buffer from
+/// before the last swap, and then swapped in. Only the watcher calls
+/// this, so there is one writer.
+///
+/// @param MIN minimum HSV thresholds for 3 channels [H S V]
+/// @param MAX maximum HSV thresholds for 3 channels [H S V]
+///
+/// @return Void
+///
+void publishThresholds(int MIN[][3], int MAX[][3]) {
+
+	int next = 1 - activeThresholdSet.load();
+	ThresholdSet &set = thresholdSets[next];
+	while (set.nReaders.load() != 0) { // a frame's copy takes microseconds
+		std::this_thread::yield();
+	}
+	memcpy(set.MIN, MIN, sizeof(set.MIN));
+	memcpy(set.MAX, MAX, sizeof(set.MAX));
+	buildColorLUTs(set.MIN, set.MAX, set.colorLUT, set.yuvLUT);
+	set.version = thresholdVersion.load() + 1;
+	activeThresholdSet.store(next);
+	thresholdVersion.store(set.version);
+}
+
+
+/// @brief Copy the last published thresholds, and the lookup tables
+/// built for them, if they are newer than the caller's
+///
+/// Called at a frame boundary. Without a reload since the caller's
+/// version this is one atomic load. The active set is pinned with its
+/// nReaders count, rechecked in case it was swapped meanwhile, and
+/// copied, so the thread never locks or waits on the watcher.
+///
+/// @param MIN gets the minimum HSV thresholds for 3 channels [H S V]
+/// @param MAX gets the maximum HSV thresholds for 3 channels [H S V]
+/// @param version version of MIN and MAX, updated when they are copied
+///
+/// @return 1 if new thresholds were copied, 0 if they were up to date
+///
+int refreshThresholds(int MIN[][3], int MAX[][3], int &version) {
+
+	int i;
+	if (thresholdVersion.load(std::memory_order_acquire) == version) {
+		return 0;
+	}
+	while (1) {
+		i = activeThresholdSet.load();
+		thresholdSets[i].nReaders++;
+		if (activeThresholdSet.load() == i) {
+			break;
+		}
+		thresholdSets[i].nReaders--; // swapped meanwhile, the watcher may be rewriting it
+	}
+	ThresholdSet &set = thresholdSets[i];
+	memcpy(MIN, set.MIN, sizeof(set.MIN));
+	memcpy(MAX, set.MAX, sizeof(set.MAX));
+	colorLUT = set.colorLUT; // the thread's own tables, no rebuild on this frame
+	yuvLUT = set.yuvLUT;
+	memcpy(lutMIN, set.MIN, sizeof(lutMIN));
+	memcpy(lutMAX, set.MAX, sizeof(lutMAX));
+	lutValidFlag = 1;
+	version = set.version;
+	set.nReaders--;
+	return 1;
+}